@@ -0,0 +1,261 @@
+
+/*
+Microbenchmarks for the fs calls. For each image size a scratch image is
+formatted, then mount, create, write, read and delete are timed across a
+range of file sizes. Each write is followed by fs_fsync, so its blocks
+have reached the disk when the clock stops. Disk traffic is the whole
+phase, commits included, divided by the number of operations, and so is
+the simulated device time when a device model is chosen with -d.
+
+Output is one line per operation, image size and file size, in fixed
+columns, so two runs can be compared with diff.
+
+The scratch image is a new file, made with mkstemp or named with -i,
+and the bench refuses to start if that name is already taken, since it
+is overwritten and removed at the end.
+*/
+
+#include "fs.h"
+#include "disk.h"
+#include "cache.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define BENCH_MAX_OPS 100
+#define BENCH_MOUNTS  5
+
+static const int image_sizes[] = { 5, 20, 1024, 16384, 262144 };
+// the largest fits the 4 MB limit of the original inode format
+static const int file_sizes[] = { 4096, 65536, 1048576, 4194304 };
+
+#define NELEM(a) (sizeof(a)/sizeof(a[0]))
+
+struct phase {
+	long start;
+	long model_start;
+	int n;
+	long ns[BENCH_MAX_OPS];
+};
+
+static void phase_begin( struct phase *p )
+{
+	stats_reset();
+	p->n = 0;
+	p->model_start = disk_model_time();
+	p->start = stats_now();
+}
+
+static int by_ns( const void *a, const void *b )
+{
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+	return x<y ? -1 : x>y;
+}
+
+static void phase_report( const char *op, int nblocks, int filesize, long bytes, struct phase *p )
+{
+	struct stats s;
+	long elapsed = stats_now()-p->start;
+	long simulated = disk_model_time()-p->model_start;
+	long reads=0, writes=0;
+	int i, c;
+
+	if(!p->n) return;
+
+	stats_get(&s);
+	for(i=0;i<STATS_OPS;i++) {
+		for(c=0;c<STATS_CLASSES;c++) {
+			reads += s.blocks[i][c][0];
+			writes += s.blocks[i][c][1];
+		}
+	}
+
+	qsort(p->ns,p->n,sizeof(long),by_ns);
+	printf("%-8s %8d %10d %5d %12.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		op,nblocks,filesize,p->n,
+		p->n/(elapsed/1e9),
+		bytes/1e6/(elapsed/1e9),
+		p->ns[p->n/2]/1e3,
+		p->ns[(p->n*99)/100]/1e3,
+		(double)reads/p->n,
+		(double)writes/p->n,
+		simulated/1e3/p->n);
+}
+
+/* time one call into the phase */
+#define TIMED(p,call) do { long t = stats_now(); call; (p)->ns[(p)->n++] = stats_now()-t; } while(0)
+
+/* disk_close and cache_close report their counters on stdout; keep them out of the table */
+static void close_quietly()
+{
+	int saved, null;
+
+	fflush(stdout);
+	saved = dup(1);
+	null = open("/dev/null",O_WRONLY);
+	if(null>=0) {
+		dup2(null,1);
+		close(null);
+	}
+
+	fs_unmount();
+	cache_close();
+	disk_close();
+
+	fflush(stdout);
+	if(saved>=0) {
+		dup2(saved,1);
+		close(saved);
+	}
+}
+
+static void bench_image( const char *filename, int nblocks, int backend, int flags, char *data )
+{
+	struct phase p;
+	int inodes[BENCH_MAX_OPS];
+	int i, f, n;
+
+	// start each image size from an empty file
+	if(truncate(filename,0)<0 || !disk_init_backend(filename,nblocks,backend)) {
+		printf("couldn't initialize %s: %s\n",filename,strerror(errno));
+		unlink(filename);
+		exit(1);
+	}
+	cache_init(CACHE_DEFAULT_CAPACITY);
+	fs_format_flags(flags);
+
+	phase_begin(&p);
+	for(i=0;i<BENCH_MOUNTS;i++) {
+		TIMED(&p,fs_mount());
+		fs_unmount();
+		cache_invalidate();
+	}
+	phase_report("mount",nblocks,0,0,&p);
+
+	fs_mount();
+
+	for(f=0;f<NELEM(file_sizes);f++) {
+		int size = file_sizes[f];
+		int fileblocks = size/DISK_BLOCK_SIZE;
+		long moved = 0;
+
+		// stay well clear of a full disk: half the blocks, and never more than the inodes
+		n = nblocks/2/(fileblocks+1);
+		if(n>(nblocks+9)/10*128-1) n = (nblocks+9)/10*128-1;
+		if(n>BENCH_MAX_OPS) n = BENCH_MAX_OPS;
+		if(n<1) continue;
+
+		phase_begin(&p);
+		for(i=0;i<n;i++) TIMED(&p,inodes[i] = fs_create());
+		phase_report("create",nblocks,size,0,&p);
+
+		phase_begin(&p);
+		for(i=0;i<n;i++) TIMED(&p,moved += fs_write(inodes[i],data,size,0); fs_fsync(inodes[i]));
+		phase_report("write",nblocks,size,moved,&p);
+
+		// start reads from a cold cache
+		cache_flush();
+		cache_invalidate();
+
+		moved = 0;
+		phase_begin(&p);
+		for(i=0;i<n;i++) TIMED(&p,moved += fs_read(inodes[i],data,size,0));
+		phase_report("read",nblocks,size,moved,&p);
+
+		phase_begin(&p);
+		for(i=0;i<n;i++) TIMED(&p,fs_delete(inodes[i]));
+		fs_commit();
+		phase_report("delete",nblocks,size,0,&p);
+	}
+
+	close_quietly();
+}
+
+int main( int argc, char *argv[] )
+{
+	char scratch[] = "bench.img.XXXXXX";
+	const char *filename = 0;
+	const char *backendname = "stdio";
+	int backend = DISK_BACKEND_STDIO;
+	int maxblocks = image_sizes[NELEM(image_sizes)-1];
+	int flags = 0;
+	const char *formatname = "plain";
+	const char *modelname = "none";
+	int model = DISK_MODEL_NONE;
+	char *data;
+	int i, fd;
+
+	for(i=1;i<argc;i++) {
+		if(!strcmp(argv[i],"-b") && i+1<argc) {
+			backendname = argv[++i];
+			backend = disk_backend_parse(backendname);
+			if(backend<0) {
+				printf("unknown disk backend: %s\n",argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i],"-f") && i+1<argc) {
+			formatname = argv[++i];
+			if(!strcmp(formatname,"extents")) {
+				flags = FS_FORMAT_EXTENTS;
+			} else if(!strcmp(formatname,"large")) {
+				flags = FS_FORMAT_LARGE;
+			} else {
+				printf("unknown format: %s\n",formatname);
+				return 1;
+			}
+		} else if(!strcmp(argv[i],"-d") && i+1<argc) {
+			modelname = argv[++i];
+			model = disk_model_parse(modelname);
+			if(model<0) {
+				printf("unknown device model: %s\n",modelname);
+				return 1;
+			}
+		} else if(!strcmp(argv[i],"-s") && i+1<argc) {
+			maxblocks = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-i") && i+1<argc) {
+			filename = argv[++i];
+		} else {
+			printf("use: %s [-b stdio|mmap|pread|direct] [-d hdd|ssd] [-f extents|large] [-s maximagesize] [-i newscratchimage]\n",argv[0]);
+			return 1;
+		}
+	}
+
+	// only ever a file made here, so the removal at the end cannot take anything else with it
+	if(filename) {
+		fd = open(filename,O_RDWR|O_CREAT|O_EXCL,0666);
+	} else {
+		fd = mkstemp(scratch);
+		filename = scratch;
+	}
+	if(fd<0) {
+		printf("couldn't create scratch image %s: %s\n",filename,strerror(errno));
+		return 1;
+	}
+	close(fd);
+
+	// page aligned, so whole blocks move straight to and from it under -b direct too
+	if(posix_memalign((void **)&data,DISK_BLOCK_SIZE,file_sizes[NELEM(file_sizes)-1])) {
+		printf("couldn't allocate a %d byte buffer\n",file_sizes[NELEM(file_sizes)-1]);
+		unlink(filename);
+		return 1;
+	}
+	memset(data,'x',file_sizes[NELEM(file_sizes)-1]);
+
+	disk_set_model(model);
+
+	printf("# simplefs-bench backend=%s format=%s model=%s cache=%d\n",backendname,formatname,modelname,CACHE_DEFAULT_CAPACITY);
+	printf("%-8s %8s %10s %5s %12s %10s %10s %10s %10s %10s %10s\n","op","blocks","filesize","n","ops/s","MB/s","p50_us","p99_us","reads/op","writes/op","sim_us/op");
+	for(i=0;i<NELEM(image_sizes) && image_sizes[i]<=maxblocks;i++) {
+		bench_image(filename,image_sizes[i],backend,flags,data);
+	}
+
+	free(data);
+	unlink(filename);
+	return 0;
+}
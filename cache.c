@@ -0,0 +1,524 @@
+// cache.c
+/*
+ * Write-back block buffer cache that sits between fs.c and disk.c.
+ * Blocks are looked up through a small hash table and evicted with the
+ * CLOCK (second chance) algorithm. Dirty blocks only reach the disk when
+ * they are evicted or when cache_flush() is called. Metadata written with
+ * cache_write_meta() is held back from eviction until cache_commit(), so a
+ * batch of changes reaches the disk once and in a safe order. If held
+ * blocks fill the whole cache, the next miss commits them all in that
+ * order instead of writing one out of turn.
+ * Every call is serialized by one lock, except cache_init, cache_invalidate
+ * and cache_close, which must not run alongside anything else. A miss is
+ * read in with the lock dropped; its frame is busy meanwhile, and anyone
+ * else after that block waits for it.
+ * ************************************************************************** */
+
+#include "cache.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/* STRUCTS ------------------------------------------------------------------ */
+
+struct cache_frame
+{
+    int blocknum;   // -1 if the frame is empty
+    int dirty;
+    int referenced; // second chance bit for CLOCK
+    int held;       // metadata waiting for cache_commit
+    int busy;       // being read from disk with the lock dropped
+    int next;       // next frame in the same hash bucket, -1 terminates
+};
+
+/* GLOBALS ------------------------------------------------------------------ */
+
+static struct cache_frame *frames;
+static char *frame_data;
+static int *buckets;
+static int nframes = 0;
+static int nbuckets = 0;
+static int hand = 0;
+static int nheld = 0;
+static struct cache_stats stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_loaded = PTHREAD_COND_INITIALIZER; // a busy frame finished loading
+
+/* FUNCTIONS ---------------------------------------------------------------- */
+
+static int hash( int blocknum )
+{
+    return (unsigned)blocknum * 2654435761u & (nbuckets - 1);
+}
+
+static char *frame_block( int f )
+{
+    return frame_data + (size_t)f * DISK_BLOCK_SIZE;
+}
+
+static int lookup( int blocknum )
+{
+    for (int f = buckets[hash(blocknum)]; f >= 0; f = frames[f].next)
+    {
+	if (frames[f].blocknum == blocknum)
+	{
+	    return f;
+	}
+    }
+    return -1;
+}
+
+/* lookup, but wait until a block being read in has arrived; the caller holds the lock */
+static int lookup_loaded( int blocknum )
+{
+    int f;
+    while ((f = lookup(blocknum)) >= 0 && frames[f].busy)
+    {
+	pthread_cond_wait(&cache_loaded, &cache_lock);
+    }
+    return f;
+}
+
+static void unlink_frame( int f )
+{
+    int *link = &buckets[hash(frames[f].blocknum)];
+    while (*link != f)
+    {
+	link = &frames[*link].next;
+    }
+    *link = frames[f].next;
+}
+
+static void release( int f )
+{
+    nheld -= frames[f].held;
+    frames[f].held = 0;
+}
+
+static int commit_order( const void *a, const void *b );
+static int write_frames( int (*compare)( const void *, const void * ) );
+
+/*
+pick a victim with CLOCK, write it back if needed and detach it; held
+frames go only when nothing else can. If every frame is being read in,
+wait for one and return -1, as the lock was dropped meanwhile.
+*/
+static int evict()
+{
+    for (int scanned = 0; ; scanned++)
+    {
+	struct cache_frame *frame = &frames[hand];
+	int f = hand;
+	hand = (hand + 1) % nframes;
+
+	if (frame->blocknum < 0)
+	{
+	    return f;
+	}
+	if (frame->busy)
+	{
+	    if (scanned >= 2 * nframes)
+	    {
+		pthread_cond_wait(&cache_loaded, &cache_lock);
+		return -1;
+	    }
+	    continue;
+	}
+	if (frame->referenced)
+	{
+	    frame->referenced = 0;
+	    continue;
+	}
+	if (frame->held && scanned < 2 * nframes)
+	{
+	    continue;
+	}
+	if (frame->held)
+	{
+	    // nothing but held metadata: commit it all, so the order between those blocks is kept
+	    write_frames(commit_order);
+	}
+
+	if (frame->dirty)
+	{
+	    disk_write(frame->blocknum, frame_block(f));
+	    stats.writebacks++;
+	}
+	unlink_frame(f);
+	release(f);
+	frame->blocknum = -1;
+	frame->dirty = 0;
+	stats.evictions++;
+	return f;
+    }
+}
+
+/* take the cache lock, setting up a default sized cache on first use */
+static void lock_cache()
+{
+    pthread_mutex_lock(&cache_lock);
+    if (!nframes)
+    {
+	// there is no cache to close yet, so cache_init takes no lock here
+	cache_init(CACHE_DEFAULT_CAPACITY);
+    }
+}
+
+/*
+find the frame holding blocknum, loading it from disk if asked to. The
+caller holds the lock; it is dropped during the read, so the disk serves
+other misses meanwhile.
+*/
+static int get_frame( int blocknum, int load )
+{
+    int f;
+    while ((f = lookup_loaded(blocknum)) < 0)
+    {
+	f = evict();
+	if (f >= 0)
+	{
+	    break;
+	}
+    }
+    if (frames[f].blocknum == blocknum)
+    {
+	stats.hits++;
+	frames[f].referenced = 1;
+	return f;
+    }
+
+    // in the table before the read, so a second miss on the block waits for this one
+    stats.misses++;
+    int b = hash(blocknum);
+    frames[f].blocknum = blocknum;
+    frames[f].referenced = 1;
+    frames[f].next = buckets[b];
+    buckets[b] = f;
+    if (load)
+    {
+	frames[f].busy = 1;
+	pthread_mutex_unlock(&cache_lock);
+	disk_read(blocknum, frame_block(f));
+	pthread_mutex_lock(&cache_lock);
+	frames[f].busy = 0;
+	pthread_cond_broadcast(&cache_loaded);
+    }
+    return f;
+}
+
+/* allocate a cache of capacity blocks, dropping (and flushing) any previous one */
+int cache_init( int capacity )
+{
+    if (capacity < 1)
+    {
+	return 0;
+    }
+
+    cache_close();
+
+    frames = malloc(capacity * sizeof(struct cache_frame));
+    // page aligned so O_DIRECT transfers need no bounce buffer
+    if (posix_memalign((void **)&frame_data, DISK_BLOCK_SIZE, (size_t)capacity * DISK_BLOCK_SIZE))
+    {
+	frame_data = 0;
+    }
+    for (nbuckets = 1; nbuckets < capacity * 2; nbuckets *= 2);
+    buckets = malloc(nbuckets * sizeof(int));
+    if (!frames || !frame_data || !buckets)
+    {
+	free(frames);
+	free(frame_data);
+	free(buckets);
+	nframes = 0;
+	return 0;
+    }
+
+    nframes = capacity;
+    cache_invalidate();
+    memset(&stats, 0, sizeof(stats));
+    return 1;
+}
+
+int cache_capacity()
+{
+    return nframes;
+}
+
+/* copy a block into data, reading it from disk only on a miss */
+void cache_read( int blocknum, char *data )
+{
+    lock_cache();
+    int f = get_frame(blocknum, 1);
+    memcpy(data, frame_block(f), DISK_BLOCK_SIZE);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* overwrite a whole block in the cache; it reaches the disk on eviction or flush */
+void cache_write( int blocknum, const char *data )
+{
+    lock_cache();
+    int f = get_frame(blocknum, 0);
+    memcpy(frame_block(f), data, DISK_BLOCK_SIZE);
+    frames[f].dirty = 1;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* write a metadata block into the cache and keep it there until the next cache_commit */
+void cache_write_meta( int blocknum, const char *data )
+{
+    lock_cache();
+    int f = get_frame(blocknum, 0);
+    memcpy(frame_block(f), data, DISK_BLOCK_SIZE);
+    frames[f].dirty = 1;
+    nheld += !frames[f].held;
+    frames[f].held = 1;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* number of blocks waiting for cache_commit */
+int cache_held()
+{
+    pthread_mutex_lock(&cache_lock);
+    int n = nheld;
+    pthread_mutex_unlock(&cache_lock);
+    return n;
+}
+
+/*
+start reading a batch of block extents. Cached copies (which may be
+dirty) are copied right away; every run of misses becomes one
+asynchronous disk request straight into the caller's buffer, and the
+whole batch is in flight at once. Misses do not fill the cache, so
+streaming file data does not push metadata out. The requests still in
+flight are returned and must be passed to cache_finish_extents. The
+lock is dropped before the requests go out, so readers on other threads
+keep the disk busy in parallel.
+*/
+struct disk_request *cache_start_extents( struct cache_extent *ext, int n, int *nreqs_out )
+{
+    struct disk_request *reqs;
+    int nreqs = 0;
+    int total = 0;
+
+    for (int e = 0; e < n; e++)
+    {
+	total += ext[e].count;
+    }
+    reqs = malloc(total * sizeof(struct disk_request));
+
+    lock_cache();
+    for (int e = 0; e < n; e++)
+    {
+	int i = 0;
+	while (i < ext[e].count)
+	{
+	    char *dest = ext[e].data + (size_t)i * DISK_BLOCK_SIZE;
+	    int f = lookup_loaded(ext[e].blocknum + i);
+	    if (f >= 0)
+	    {
+		stats.hits++;
+		frames[f].referenced = 1;
+		memcpy(dest, frame_block(f), DISK_BLOCK_SIZE);
+		i++;
+		continue;
+	    }
+
+	    int run = 1;
+	    while (i + run < ext[e].count && lookup(ext[e].blocknum + i + run) < 0)
+	    {
+		run++;
+	    }
+	    stats.misses += run;
+
+	    if (reqs)
+	    {
+		reqs[nreqs].blocknum = ext[e].blocknum + i;
+		reqs[nreqs].count = run;
+		reqs[nreqs].write = 0;
+		reqs[nreqs].data = dest;
+		nreqs++;
+	    }
+	    else
+	    {
+		disk_read_range(ext[e].blocknum + i, run, dest);
+	    }
+	    i += run;
+	}
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    disk_submit(reqs, nreqs);
+    *nreqs_out = nreqs;
+    return reqs;
+}
+
+/* wait for the requests of cache_start_extents and release them */
+void cache_finish_extents( struct disk_request *reqs, int nreqs )
+{
+    disk_wait(reqs, nreqs);
+    free(reqs);
+}
+
+/* read a batch of block extents and wait for them, see cache_start_extents */
+void cache_read_extents( struct cache_extent *ext, int n )
+{
+    int nreqs;
+    struct disk_request *reqs = cache_start_extents(ext, n, &nreqs);
+    cache_finish_extents(reqs, nreqs);
+}
+
+/* read count consecutive blocks into data, see cache_read_extents */
+void cache_read_range( int blocknum, int count, char *data )
+{
+    struct cache_extent ext = { blocknum, count, data };
+    cache_read_extents(&ext, 1);
+}
+
+/*
+write count consecutive blocks through to disk in one request. Cached
+copies are refreshed and marked clean first, so no older dirty copy can
+be written back over the new data once the lock is dropped.
+*/
+void cache_write_range( int blocknum, int count, const char *data )
+{
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < count && nframes; i++)
+    {
+	int f = lookup_loaded(blocknum + i);
+	if (f >= 0)
+	{
+	    memcpy(frame_block(f), data + (size_t)i * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+	    frames[f].dirty = 0;
+	    release(f);
+	}
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    disk_write_range(blocknum, count, data);
+}
+
+static int by_blocknum( const void *a, const void *b )
+{
+    return frames[*(const int *)a].blocknum - frames[*(const int *)b].blocknum;
+}
+
+/* plain blocks first in block order, then held metadata from the highest block down */
+static int commit_order( const void *a, const void *b )
+{
+    struct cache_frame *x = &frames[*(const int *)a];
+    struct cache_frame *y = &frames[*(const int *)b];
+    if (x->held != y->held)
+    {
+	return x->held - y->held;
+    }
+    return x->held ? y->blocknum - x->blocknum : x->blocknum - y->blocknum;
+}
+
+/* write every dirty block back to disk in the order compare gives, releasing held ones; the caller holds the lock */
+static int write_frames( int (*compare)( const void *, const void * ) )
+{
+    int *order = malloc(nframes * sizeof(int));
+    int ndirty = 0;
+
+    if (!order)
+    {
+	return 0;
+    }
+
+    for (int f = 0; f < nframes; f++)
+    {
+	if (frames[f].blocknum >= 0 && frames[f].dirty)
+	{
+	    order[ndirty++] = f;
+	}
+    }
+
+    qsort(order, ndirty, sizeof(int), compare);
+
+    for (int i = 0; i < ndirty; i++)
+    {
+	disk_write(frames[order[i]].blocknum, frame_block(order[i]));
+	frames[order[i]].dirty = 0;
+	release(order[i]);
+	stats.writebacks++;
+    }
+    free(order);
+    return 1;
+}
+
+static void write_back( int (*compare)( const void *, const void * ) )
+{
+    pthread_mutex_lock(&cache_lock);
+    write_frames(compare);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* write every dirty block back to disk in block order */
+void cache_flush()
+{
+    // sorting keeps the write-back sequential on disk
+    write_back(by_blocknum);
+}
+
+/*
+write every dirty block back, data before metadata. The metadata goes
+highest block first, so pointer blocks in the data area land before the
+bitmap and inode blocks that lead to them, and an inode never points at
+a block that is not on disk yet.
+*/
+void cache_commit()
+{
+    write_back(commit_order);
+}
+
+/* forget every cached block without writing anything back */
+void cache_invalidate()
+{
+    for (int f = 0; f < nframes; f++)
+    {
+	frames[f].blocknum = -1;
+	frames[f].dirty = 0;
+	frames[f].referenced = 0;
+	frames[f].held = 0;
+	frames[f].busy = 0;
+	frames[f].next = -1;
+    }
+    for (int i = 0; i < nbuckets; i++)
+    {
+	buckets[i] = -1;
+    }
+    hand = 0;
+    nheld = 0;
+}
+
+/* flush and release the cache, reporting how well it did */
+void cache_close()
+{
+    if (!nframes)
+    {
+	return;
+    }
+
+    cache_flush();
+    printf("%ld cache hits\n", stats.hits);
+    printf("%ld cache misses\n", stats.misses);
+    printf("%ld cache evictions\n", stats.evictions);
+
+    free(frames);
+    free(frame_data);
+    free(buckets);
+    frames = 0;
+    frame_data = 0;
+    buckets = 0;
+    nframes = 0;
+}
+
+void cache_get_stats( struct cache_stats *s )
+{
+    pthread_mutex_lock(&cache_lock);
+    *s = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,40 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "disk.h"
+
+#define CACHE_DEFAULT_CAPACITY 256
+
+struct cache_stats
+{
+    long hits;
+    long misses;
+    long evictions;
+    long writebacks;
+};
+
+struct cache_extent
+{
+    int blocknum;
+    int count;
+    char *data;
+};
+
+int  cache_init( int capacity );
+int  cache_capacity();
+void cache_read( int blocknum, char *data );
+void cache_write( int blocknum, const char *data );
+void cache_write_meta( int blocknum, const char *data );
+void cache_read_range( int blocknum, int count, char *data );
+void cache_write_range( int blocknum, int count, const char *data );
+void cache_read_extents( struct cache_extent *ext, int n );
+struct disk_request *cache_start_extents( struct cache_extent *ext, int n, int *nreqs );
+void cache_finish_extents( struct disk_request *reqs, int nreqs );
+void cache_flush();
+void cache_commit();
+int  cache_held();
+void cache_invalidate();
+void cache_close();
+void cache_get_stats( struct cache_stats *stats );
+
+#endif
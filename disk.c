@@ -1,48 +1,265 @@
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "disk.h"
+#include "stats.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
+static const char *backend_names[] = { "stdio", "mmap", "pread", "direct" };
+
+/*
+Device model: simulated time charged per request, on top of whatever the
+host really took. A request that does not start where the last one ended
+pays a seek of settle time plus half a rotation plus a share of the full
+stroke proportional to the distance; every request pays a fixed overhead
+and a transfer time per block. Nothing sleeps, so runs stay fast and the
+totals are repeatable for the same sequence of requests. The device
+serves one request at a time, so overlapping requests add up. Requests
+queued with disk_submit are charged in submission order when they are
+queued, not in whatever order the workers finish them, so a queue depth
+does not change the totals. Several threads calling in at once still
+make the order, and with it the totals, depend on scheduling.
+*/
+
+struct disk_model {
+	const char *name;
+	long request_ns;
+	long settle_ns;
+	long rotation_ns;
+	long stroke_ns;
+	long block_ns;
+};
+
+static const struct disk_model models[] = {
+	{ "none", 0, 0, 0, 0, 0 },
+	{ "hdd", 50000, 1000000, 8333333, 15000000, 27000 }, // 7200 rpm, 150 MB/s
+	{ "ssd", 25000, 0, 0, 0, 8000 },                     // 500 MB/s, no seek penalty
+};
+
 static FILE *diskfile;
+static int diskfd=-1;
+static char *diskmap;
+static int backend=DISK_BACKEND_STDIO;
 static int nblocks=0;
 static int nreads=0;
 static int nwrites=0;
+static int nreadreqs=0;
+static int nwritereqs=0;
+
+static pthread_t *workers;
+static int nworkers=0;
+static int stopping=0;
+static struct disk_request *queue_head;
+static struct disk_request *queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_done = PTHREAD_COND_INITIALIZER;
+
+static int model=DISK_MODEL_NONE;
+static long model_ns=0;
+static long model_seeks=0;
+static int model_head=0;
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static FILE *tracefile;
+static long tracestart;
+static int resize = 1; // whether init creates and sizes the image; disk_open_backend clears it
+static __thread int precharged; // a worker runs a request the model was charged for at submission
 
 int disk_init( const char *filename, int n )
+{
+	return disk_init_backend(filename,n,DISK_BACKEND_STDIO);
+}
+
+static int set_size( int fd, int n )
+{
+	return !resize || ftruncate(fd,(off_t)n*DISK_BLOCK_SIZE)==0;
+}
+
+static int stdio_init( const char *filename, int n )
 {
 	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
+	if(!diskfile && resize) diskfile = fopen(filename,"w+");
 	if(!diskfile) return 0;
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	set_size(fileno(diskfile),n);
+	return 1;
+}
+
+static int mmap_init( const char *filename, int n )
+{
+	size_t length = (size_t)n*DISK_BLOCK_SIZE;
+
+	diskfd = open(filename,O_RDWR|(resize ? O_CREAT : 0),0666);
+	if(diskfd<0) return 0;
+
+	if(!set_size(diskfd,n) || length==0) {
+		close(diskfd);
+		diskfd = -1;
+		return 0;
+	}
+
+	diskmap = mmap(0,length,PROT_READ|PROT_WRITE,MAP_SHARED,diskfd,0);
+	if(diskmap==MAP_FAILED) {
+		diskmap = 0;
+		close(diskfd);
+		diskfd = -1;
+		return 0;
+	}
+
+	return 1;
+}
 
+static int fd_init( const char *filename, int n, int flags )
+{
+	diskfd = open(filename,O_RDWR|(resize ? O_CREAT : 0)|flags,0666);
+	if(diskfd<0) return 0;
+
+	if(!set_size(diskfd,n)) {
+		close(diskfd);
+		diskfd = -1;
+		return 0;
+	}
+
+	return 1;
+}
+
+int disk_init_backend( const char *filename, int n, int b )
+{
+	int result;
+
+	switch(b) {
+		case DISK_BACKEND_STDIO:
+			result = stdio_init(filename,n);
+			break;
+		case DISK_BACKEND_MMAP:
+			result = mmap_init(filename,n);
+			break;
+		case DISK_BACKEND_PREAD:
+			result = fd_init(filename,n,0);
+			break;
+		case DISK_BACKEND_DIRECT:
+			result = fd_init(filename,n,O_DIRECT);
+			break;
+		default:
+			errno = EINVAL;
+			return 0;
+	}
+	if(!result) return 0;
+
+	backend = b;
 	nblocks = n;
+	stats_init(n);
+	model_ns = 0;
+	model_seeks = 0;
+	model_head = 0;
 	nreads = 0;
 	nwrites = 0;
+	nreadreqs = 0;
+	nwritereqs = 0;
 
 	return 1;
 }
 
+/* open an image that already exists at its own size, without creating or resizing it; disk_size() tells how big it is */
+int disk_open_backend( const char *filename, int b )
+{
+	struct stat info;
+	int result;
+
+	if(stat(filename,&info)<0) return 0;
+
+	resize = 0;
+	result = disk_init_backend(filename,info.st_size/DISK_BLOCK_SIZE,b);
+	resize = 1;
+	return result;
+}
+
+int disk_backend_parse( const char *name )
+{
+	int i;
+	for(i=0;i<sizeof(backend_names)/sizeof(backend_names[0]);i++) {
+		if(!strcmp(name,backend_names[i])) return i;
+	}
+	return -1;
+}
+
+const char *disk_backend_name()
+{
+	return backend_names[backend];
+}
+
 int disk_size()
 {
 	return nblocks;
 }
 
-static void sanity_check( int blocknum, const void *data )
+void disk_set_model( int m )
+{
+	model = m;
+}
+
+int disk_model_parse( const char *name )
+{
+	int i;
+	for(i=0;i<sizeof(models)/sizeof(models[0]);i++) {
+		if(!strcmp(name,models[i].name)) return i;
+	}
+	return -1;
+}
+
+/* simulated nanoseconds charged so far */
+long disk_model_time()
+{
+	long ns;
+
+	pthread_mutex_lock(&model_lock);
+	ns = model_ns;
+	pthread_mutex_unlock(&model_lock);
+
+	return ns;
+}
+
+static void model_charge( int blocknum, int count )
+{
+	const struct disk_model *m = &models[model];
+	long distance;
+
+	if(model==DISK_MODEL_NONE || precharged) return;
+
+	pthread_mutex_lock(&model_lock);
+	distance = blocknum>model_head ? blocknum-model_head : model_head-blocknum;
+	if(distance) {
+		model_ns += m->settle_ns+m->rotation_ns/2+m->stroke_ns*distance/nblocks;
+		model_seeks++;
+	}
+	model_ns += m->request_ns+m->block_ns*count;
+	model_head = blocknum+count;
+	pthread_mutex_unlock(&model_lock);
+}
+
+static void sanity_check_range( int blocknum, int count, const void *data )
 {
 	if(blocknum<0) {
 		printf("ERROR: blocknum (%d) is negative!\n",blocknum);
 		abort();
 	}
 
-	if(blocknum>=nblocks) {
-		printf("ERROR: blocknum (%d) is too big!\n",blocknum);
+	if(count<1 || blocknum>nblocks-count) {
+		printf("ERROR: blocknum (%d) is too big!\n",blocknum+count-1);
 		abort();
 	}
 
@@ -52,41 +269,476 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
-void disk_read( int blocknum, char *data )
+static void sanity_check( int blocknum, const void *data )
 {
-	sanity_check(blocknum,data);
+	sanity_check_range(blocknum,1,data);
+}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+static void io_error()
+{
+	printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+	abort();
+}
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
-	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+/*
+O_DIRECT requires the user buffer to be aligned as well as the offset,
+so unaligned callers are bounced through an aligned buffer on the stack.
+*/
+
+static int is_aligned( const void *data )
+{
+	return ((unsigned long)data & (DISK_BLOCK_SIZE-1))==0;
+}
+
+static void fd_read( int blocknum, char *data )
+{
+	char bounce[DISK_BLOCK_SIZE] __attribute__((aligned(DISK_BLOCK_SIZE)));
+	char *buf = backend==DISK_BACKEND_DIRECT && !is_aligned(data) ? bounce : data;
+
+	if(pread(diskfd,buf,DISK_BLOCK_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE)!=DISK_BLOCK_SIZE) io_error();
+	if(buf!=data) memcpy(data,buf,DISK_BLOCK_SIZE);
+}
+
+static void fd_write( int blocknum, const char *data )
+{
+	char bounce[DISK_BLOCK_SIZE] __attribute__((aligned(DISK_BLOCK_SIZE)));
+	const char *buf = data;
+
+	if(backend==DISK_BACKEND_DIRECT && !is_aligned(data)) {
+		memcpy(bounce,data,DISK_BLOCK_SIZE);
+		buf = bounce;
+	}
+
+	if(pwrite(diskfd,buf,DISK_BLOCK_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE)!=DISK_BLOCK_SIZE) io_error();
+}
+
+/*
+Vectored transfers: count consecutive blocks starting at blocknum, moved
+to or from one buffer per block. Each call is a single request to the
+backend unless O_DIRECT forces unaligned buffers through the bounce path.
+*/
+
+static void fd_readv( int blocknum, int count, char **bufs )
+{
+	struct iovec iov[IOV_MAX];
+	int i, n;
+
+	for(i=0;i<count;i++) {
+		if(backend==DISK_BACKEND_DIRECT && !is_aligned(bufs[i])) break;
+	}
+	if(i<count) {
+		for(i=0;i<count;i++) fd_read(blocknum+i,bufs[i]);
+		return;
+	}
+
+	for(i=0;i<count;i+=n) {
+		n = count-i<IOV_MAX ? count-i : IOV_MAX;
+		for(int j=0;j<n;j++) {
+			iov[j].iov_base = bufs[i+j];
+			iov[j].iov_len = DISK_BLOCK_SIZE;
+		}
+		if(preadv(diskfd,iov,n,(off_t)(blocknum+i)*DISK_BLOCK_SIZE)!=(ssize_t)n*DISK_BLOCK_SIZE) io_error();
+	}
+}
+
+static void fd_writev( int blocknum, int count, char *const *bufs )
+{
+	struct iovec iov[IOV_MAX];
+	int i, n;
+
+	for(i=0;i<count;i++) {
+		if(backend==DISK_BACKEND_DIRECT && !is_aligned(bufs[i])) break;
+	}
+	if(i<count) {
+		for(i=0;i<count;i++) fd_write(blocknum+i,bufs[i]);
+		return;
+	}
+
+	for(i=0;i<count;i+=n) {
+		n = count-i<IOV_MAX ? count-i : IOV_MAX;
+		for(int j=0;j<n;j++) {
+			iov[j].iov_base = bufs[i+j];
+			iov[j].iov_len = DISK_BLOCK_SIZE;
+		}
+		if(pwritev(diskfd,iov,n,(off_t)(blocknum+i)*DISK_BLOCK_SIZE)!=(ssize_t)n*DISK_BLOCK_SIZE) io_error();
 	}
 }
 
+/*
+Tracing: while a trace file is open, every request is appended to it as
+a fixed size record giving the time it was issued, where it went, and
+the fs call it was charged to. No data is recorded, so a trace can be
+shared where the image cannot. simplefs-replay plays one back.
+*/
+
+int disk_trace_open( const char *filename )
+{
+	struct disk_trace_header header;
+
+	disk_trace_close();
+
+	tracefile = fopen(filename,"w");
+	if(!tracefile) return 0;
+
+	header.magic = DISK_TRACE_MAGIC;
+	header.nblocks = nblocks;
+	if(fwrite(&header,sizeof(header),1,tracefile)!=1) {
+		fclose(tracefile);
+		tracefile = 0;
+		return 0;
+	}
+
+	tracestart = stats_now();
+	return 1;
+}
+
+void disk_trace_close()
+{
+	if(!tracefile) return;
+
+	fclose(tracefile);
+	tracefile = 0;
+}
+
+static void trace( long start, int blocknum, int count, int write )
+{
+	struct disk_trace_record r;
+
+	if(!tracefile) return;
+
+	r.time = start-tracestart;
+	r.write = write;
+	r.op = stats_op();
+	// a record holds at most 65535 blocks; longer requests are split
+	while(count>0) {
+		r.blocknum = blocknum;
+		r.count = count<UINT16_MAX ? count : UINT16_MAX;
+		fwrite(&r,sizeof(r),1,tracefile);
+		blocknum += r.count;
+		count -= r.count;
+	}
+}
+
+void disk_readv( int blocknum, char **bufs, int count )
+{
+	long start = stats_now();
+
+	sanity_check_range(blocknum,count,bufs);
+
+	switch(backend) {
+		case DISK_BACKEND_MMAP:
+			for(int i=0;i<count;i++) {
+				memcpy(bufs[i],diskmap+(size_t)(blocknum+i)*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+			}
+			break;
+		case DISK_BACKEND_PREAD:
+		case DISK_BACKEND_DIRECT:
+			fd_readv(blocknum,count,bufs);
+			break;
+		default:
+			// the stream lock keeps the seek and the reads together
+			flockfile(diskfile);
+			fseek(diskfile,(off_t)blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+			for(int i=0;i<count;i++) {
+				if(fread(bufs[i],DISK_BLOCK_SIZE,1,diskfile)!=1) io_error();
+			}
+			funlockfile(diskfile);
+			break;
+	}
+
+	__sync_fetch_and_add(&nreads,count);
+	__sync_fetch_and_add(&nreadreqs,1);
+	stats_io(blocknum,count,0,stats_now()-start);
+	trace(start,blocknum,count,0);
+	model_charge(blocknum,count);
+}
+
+void disk_writev( int blocknum, char *const *bufs, int count )
+{
+	long start = stats_now();
+
+	sanity_check_range(blocknum,count,bufs);
+
+	switch(backend) {
+		case DISK_BACKEND_MMAP:
+			for(int i=0;i<count;i++) {
+				memcpy(diskmap+(size_t)(blocknum+i)*DISK_BLOCK_SIZE,bufs[i],DISK_BLOCK_SIZE);
+			}
+			break;
+		case DISK_BACKEND_PREAD:
+		case DISK_BACKEND_DIRECT:
+			fd_writev(blocknum,count,bufs);
+			break;
+		default:
+			flockfile(diskfile);
+			fseek(diskfile,(off_t)blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+			for(int i=0;i<count;i++) {
+				if(fwrite(bufs[i],DISK_BLOCK_SIZE,1,diskfile)!=1) io_error();
+			}
+			funlockfile(diskfile);
+			break;
+	}
+
+	__sync_fetch_and_add(&nwrites,count);
+	__sync_fetch_and_add(&nwritereqs,1);
+	stats_io(blocknum,count,1,stats_now()-start);
+	trace(start,blocknum,count,1);
+	model_charge(blocknum,count);
+}
+
+/*
+Range transfers are vectored transfers whose buffers are laid out back
+to back; the buffer table is built in chunks so the stack stays small.
+*/
+
+#define RANGE_CHUNK 256
+
+void disk_read_range( int blocknum, int count, char *data )
+{
+	char *bufs[RANGE_CHUNK];
+	int i, n;
+
+	sanity_check_range(blocknum,count,data);
+
+	for(i=0;i<count;i+=n) {
+		n = count-i<RANGE_CHUNK ? count-i : RANGE_CHUNK;
+		for(int j=0;j<n;j++) bufs[j] = data+(size_t)(i+j)*DISK_BLOCK_SIZE;
+		disk_readv(blocknum+i,bufs,n);
+	}
+}
+
+void disk_write_range( int blocknum, int count, const char *data )
+{
+	char *bufs[RANGE_CHUNK];
+	int i, n;
+
+	sanity_check_range(blocknum,count,data);
+
+	for(i=0;i<count;i+=n) {
+		n = count-i<RANGE_CHUNK ? count-i : RANGE_CHUNK;
+		for(int j=0;j<n;j++) bufs[j] = (char *)data+(size_t)(i+j)*DISK_BLOCK_SIZE;
+		disk_writev(blocknum+i,bufs,n);
+	}
+}
+
+void disk_read( int blocknum, char *data )
+{
+	sanity_check(blocknum,data);
+	disk_readv(blocknum,&data,1);
+}
+
 void disk_write( int blocknum, const char *data )
 {
 	sanity_check(blocknum,data);
+	disk_writev(blocknum,(char **)&data,1);
+}
+
+/*
+Give the space behind count blocks back to the host by punching a hole
+in the image file; the blocks read back as zeros afterwards. Returns 0
+if the host file system cannot do that, in which case nothing changed.
+*/
+
+int disk_discard( int blocknum, int count )
+{
+	int fd = diskfd;
+
+	sanity_check_range(blocknum,count,&fd);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	if(diskfile) {
+		fflush(diskfile);
+		fd = fileno(diskfile);
+	}
+
+	return fallocate(fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE,(off_t)count*DISK_BLOCK_SIZE)==0;
+}
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+/*
+Asynchronous submission: a pool of worker threads, one per slot of
+queue depth, pulls requests off a FIFO and runs them through the
+ordinary range calls. Without a pool, disk_submit completes requests
+synchronously so callers need no second code path.
+*/
+
+static void execute( struct disk_request *r )
+{
+	if(r->write) {
+		disk_write_range(r->blocknum,r->count,r->data);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		disk_read_range(r->blocknum,r->count,r->data);
 	}
 }
 
+static void *worker( void *arg )
+{
+	struct disk_request *r;
+
+	pthread_mutex_lock(&queue_lock);
+	while(1) {
+		while(!queue_head && !stopping) pthread_cond_wait(&queue_ready,&queue_lock);
+		if(!queue_head) break;
+
+		r = queue_head;
+		queue_head = r->next;
+		if(!queue_head) queue_tail = 0;
+		pthread_mutex_unlock(&queue_lock);
+
+		// charge the transfer to the call that submitted it
+		stats_set_op(r->op);
+		precharged = 1;
+		execute(r);
+
+		pthread_mutex_lock(&queue_lock);
+		r->done = 1;
+		pthread_cond_broadcast(&queue_done);
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	return 0;
+}
+
+int disk_aio_init( int depth )
+{
+	int i;
+
+	disk_aio_close();
+	if(depth<1) return 1;
+
+	workers = malloc(depth*sizeof(pthread_t));
+	if(!workers) return 0;
+
+	for(i=0;i<depth;i++) {
+		if(pthread_create(&workers[i],0,worker,0)) break;
+	}
+	nworkers = i;
+
+	return nworkers==depth;
+}
+
+int disk_aio_depth()
+{
+	return nworkers;
+}
+
+void disk_submit( struct disk_request *reqs, int n )
+{
+	int i;
+
+	if(!nworkers) {
+		for(i=0;i<n;i++) {
+			execute(&reqs[i]);
+			reqs[i].done = 1;
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&queue_lock);
+	for(i=0;i<n;i++) {
+		// the queue lock keeps this in the order the workers are handed the requests
+		model_charge(reqs[i].blocknum,reqs[i].count);
+		reqs[i].op = stats_op();
+		reqs[i].done = 0;
+		reqs[i].next = 0;
+		if(queue_tail) {
+			queue_tail->next = &reqs[i];
+		} else {
+			queue_head = &reqs[i];
+		}
+		queue_tail = &reqs[i];
+	}
+	pthread_cond_broadcast(&queue_ready);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+int disk_poll( struct disk_request *r )
+{
+	int done;
+
+	pthread_mutex_lock(&queue_lock);
+	done = r->done;
+	pthread_mutex_unlock(&queue_lock);
+
+	return done;
+}
+
+void disk_wait( struct disk_request *reqs, int n )
+{
+	int i;
+
+	pthread_mutex_lock(&queue_lock);
+	for(i=0;i<n;i++) {
+		while(!reqs[i].done) pthread_cond_wait(&queue_done,&queue_lock);
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void disk_aio_close()
+{
+	int i;
+
+	if(!nworkers) return;
+
+	pthread_mutex_lock(&queue_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&queue_ready);
+	pthread_mutex_unlock(&queue_lock);
+
+	for(i=0;i<nworkers;i++) pthread_join(workers[i],0);
+
+	free(workers);
+	workers = 0;
+	nworkers = 0;
+	stopping = 0;
+}
+
+/*
+Zero-copy read access for the mmap backend: returns a pointer straight
+into the mapped image, or null if the backend has no mapping. Each call
+is accounted as a one block read request. The block is read only;
+changes go through disk_write, so they reach the stats and the trace.
+*/
+
+const char *disk_block_ptr( int blocknum )
+{
+	long start = stats_now();
+
+	if(!diskmap) return 0;
+
+	sanity_check(blocknum,diskmap);
+	__sync_fetch_and_add(&nreads,1);
+	__sync_fetch_and_add(&nreadreqs,1);
+	stats_io(blocknum,1,0,stats_now()-start);
+	trace(start,blocknum,1,0);
+	model_charge(blocknum,1);
+	return diskmap+(size_t)blocknum*DISK_BLOCK_SIZE;
+}
+
 void disk_close()
 {
-	if(diskfile) {
+	disk_aio_close();
+	disk_trace_close();
+
+	if(diskfile || diskfd>=0) {
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
+		printf("%d disk read requests\n",nreadreqs);
+		printf("%d disk write requests\n",nwritereqs);
+		if(model!=DISK_MODEL_NONE) {
+			printf("%.3f s simulated %s time, %ld seeks\n",model_ns/1e9,models[model].name,model_seeks);
+		}
+	}
+	if(diskfile) {
 		fclose(diskfile);
 		diskfile = 0;
 	}
+	if(diskmap) {
+		msync(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE,MS_SYNC);
+		munmap(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE);
+		diskmap = 0;
+	}
+	if(diskfd>=0) {
+		close(diskfd);
+		diskfd = -1;
+	}
 }
 
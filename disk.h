@@ -1,12 +1,70 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdint.h>
+
 #define DISK_BLOCK_SIZE 4096
 
+#define DISK_BACKEND_STDIO  0
+#define DISK_BACKEND_MMAP   1
+#define DISK_BACKEND_PREAD  2
+#define DISK_BACKEND_DIRECT 3
+
+#define DISK_MODEL_NONE 0
+#define DISK_MODEL_HDD  1
+#define DISK_MODEL_SSD  2
+
+#define DISK_TRACE_MAGIC 0x53465452 // "SFTR"
+
+/* a trace file is one disk_trace_header followed by one record per request */
+struct disk_trace_header {
+	uint32_t magic;
+	uint32_t nblocks;
+};
+
+struct disk_trace_record {
+	uint64_t time;     // nanoseconds since the trace was opened
+	uint32_t blocknum;
+	uint16_t count;
+	uint8_t write;
+	uint8_t op;        // stats call the request was charged to
+};
+
+struct disk_request {
+	int blocknum;
+	int count;
+	int write;
+	char *data;
+	int done;
+	int op; // stats call the transfer is charged to
+	struct disk_request *next;
+};
+
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_backend( const char *filename, int nblocks, int backend );
+int  disk_open_backend( const char *filename, int backend );
+int  disk_backend_parse( const char *name );
+const char *disk_backend_name();
 int  disk_size();
+void disk_set_model( int model );
+int  disk_model_parse( const char *name );
+long disk_model_time();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_read_range( int blocknum, int count, char *data );
+void disk_write_range( int blocknum, int count, const char *data );
+void disk_readv( int blocknum, char **bufs, int count );
+void disk_writev( int blocknum, char *const *bufs, int count );
+int  disk_discard( int blocknum, int count );
+const char *disk_block_ptr( int blocknum );
+int  disk_aio_init( int depth );
+int  disk_aio_depth();
+void disk_submit( struct disk_request *reqs, int n );
+int  disk_poll( struct disk_request *req );
+void disk_wait( struct disk_request *reqs, int n );
+void disk_aio_close();
+int  disk_trace_open( const char *filename );
+void disk_trace_close();
 void disk_close();
 
 
@@ -3,8 +3,12 @@
  *
  * ************************************************************************** */
 
+#define _GNU_SOURCE
+
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -12,18 +16,57 @@
 #include <errno.h>
 #include <unistd.h>
 #include <math.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
 #define DISK_BLOCK_SIZE	    4096
 #define FS_MAGIC	    0xf0f03410
+#define FS_MAGIC_V2	    0xf0f03420 // inodes hold extents instead of block pointers
+#define FS_MAGIC_V3	    0xf0f03430 // inodes hold indirect trees and a 64-bit size
 #define INODES_PER_BLOCK    128
 #define POINTERS_PER_INODE  5 // Pointers in inode structure
 #define POINTERS_PER_BLOCK  1024 // Pointers in indirect block
+#define EXTENTS_PER_INODE   2    // Extents in a v2 inode
+#define EXTENTS_PER_BLOCK   512  // Extents in a v2 overflow block
+#define LARGE_DIRECT        2    // Direct pointers in a v3 inode
+#define LARGE_TREES         3    // Single, double and triple indirect pointers in a v3 inode
+#define IFREE_WORDS         (INODES_PER_BLOCK / 64) // Free inode bitmap words per inode block
+#define BITS_PER_BLOCK      (DISK_BLOCK_SIZE * 8) // Blocks tracked per bitmap block
+#define AIO_BATCH           64   // Blocks handled per asynchronous batch
+#define AIO_MAX_RUN         8    // Largest single request in a batch
+#define ZERO_RUN            256  // Blocks per write when zeroing the inode table
+#define RA_STREAMS          8    // Inodes tracked for sequential reads at once
+#define RA_MIN              8    // First readahead window, in blocks
+#define RA_MAX              128  // Largest readahead window, in blocks
+#define DIRTY_SLOTS         8    // Inodes with buffered writes at once
+#define DIRTY_MAX           256  // Blocks buffered per inode before a flush
+#define DIRTY_SLACK         4    // Blocks reserved per buffered run for indirect and overflow blocks
+#define INODE_LOCKS         64   // Reader/writer locks, shared by inumber % INODE_LOCKS
+#define COMMIT_OPS          1024 // Changes collected before an automatic group commit
+#define COMMIT_MS           1000 // How often the commit timer writes out what has collected
+#define DIR_MAGIC           0xf0f0d100
+#define DIR_INDEX_BLOCKS    16   // Directory blocks 1..16 hold the bucket index
+#define DIR_MAX_DEPTH       14   // 2^14 index entries fill the index blocks
+#define DIRENTS_PER_BLOCK   63   // Entries in a directory bucket
+#define DCACHE_SLOTS        4096 // Names remembered by the dentry cache
+#define INODE_FILE          1    // isvalid type of a regular file
+#define INODE_DIR           2    // isvalid type of a directory
+#define INODE_TYPE          0xff // Low byte of isvalid: the type, 0 when the inode is free
+#define INODE_GEN_SHIFT     8    // Above it: a generation, bumped each time the inode is created
+#define INODE_ANY_GEN       ~0u  // delete_inode: whatever generation the inode holds
 
 /* STRUCTS ------------------------------------------------------------------ */
 
 struct Disk 
 {
     int mounted;
+    int nblocks;
+    int bitmap_start;
+    int nbitmapblocks;
+    int extents;    // inodes hold extents (FS_MAGIC_V2)
+    int large;      // inodes hold indirect trees (FS_MAGIC_V3)
 };
 
 struct fs_superblock 
@@ -32,623 +75,3825 @@ struct fs_superblock
     int nblocks;
     int ninodeblocks;
     int ninodes;
+    int nbitmapblocks; // free bitmap blocks following the inode table
+    int clean;         // set by fs_unmount, cleared while mounted
+};
+
+// A run of length consecutive disk blocks starting at start
+struct fs_extent
+{
+    int start;
+    int length;
 };
 
+// All layouts fit in the same 32 bytes; the superblock magic says which one is used
 struct fs_inode 
 {
     int isvalid;
     int size;
-    int direct[POINTERS_PER_INODE];
-    int indirect;
+    union
+    {
+	struct
+	{
+	    int direct[POINTERS_PER_INODE];
+	    int indirect;
+	};
+	struct
+	{
+	    int nextents;
+	    struct fs_extent extents[EXTENTS_PER_INODE];
+	    int overflow; // block holding extents past the first EXTENTS_PER_INODE
+	};
+	struct
+	{
+	    int size_hi;  // upper half of the 64-bit size
+	    int blocks[LARGE_DIRECT];
+	    int tree[LARGE_TREES]; // tree[t] is t + 1 levels of pointer blocks deep
+	};
+    };
+};
+
+// Block 0 of a directory; an all-zero header is an empty directory
+struct fs_dir_header
+{
+    int magic;
+    int depth;      // global depth: the index has 2^depth entries
+    int nbuckets;   // buckets follow the index blocks
+    int count;      // entries in the whole directory
+};
+
+// One name in a directory
+struct fs_dirent
+{
+    int inumber;
+    unsigned gen;   // generation of the inode the name was made for
+    unsigned hash;
+    char name[FS_NAME_MAX + 1];
 };
 
-// Represents 4 different ways of interpreting raw disk data
+// A directory block holding the names whose hashes end in the same depth bits
+struct fs_dir_bucket
+{
+    int depth;      // local depth
+    int count;
+    struct fs_dirent entries[DIRENTS_PER_BLOCK];
+};
+
+// Represents 7 different ways of interpreting raw disk data
 union fs_block 
 {
     struct fs_superblock super;
     struct fs_inode inodes[INODES_PER_BLOCK];
     int pointers[POINTERS_PER_BLOCK];
+    struct fs_extent extents[EXTENTS_PER_BLOCK];
+    struct fs_dir_header dir;
+    struct fs_dir_bucket bucket;
     char data[DISK_BLOCK_SIZE];
 };
 
-/* GLOBALS ------------------------------------------------------------------ */
-
-static struct Disk disk;
-int *bitmap;
-
-/* FUNCTIONS ---------------------------------------------------------------- */
-
-/* creates a new filesystem on the disk, destroys data already present */
-int fs_format()
+// The pointer block at one depth of the last v3 tree walk
+struct map_level
 {
-    if (disk.mounted) 
-    { // return failure if disk is mounted
-	return 0; 
-    }
-
-    // set up super block
+    int blocknum;   // 0 when nothing is loaded
+    int dirty;
     union fs_block block;
-    block.super.magic = FS_MAGIC;
-    block.super.nblocks = disk_size();
-	
-    // 10% of these to inodes
-    int nblocks = block.super.nblocks;
-    double ninodes = (double)nblocks * 0.1;
-    
-    // round up ninodes (from exactly 10%)
-    if ((int) ninodes < ninodes)
-    {
-	block.super.ninodeblocks = (int)ninodes + 1;
-    }
-    else
-    {
-	block.super.ninodeblocks = (int)ninodes;
-    }
+};
 
-    block.super.ninodes = block.super.ninodeblocks * INODES_PER_BLOCK;
+// An inode together with its indirect (or extent overflow) block, loaded only when needed
+struct fs_map
+{
+    int inumber;
+    struct fs_inode inode;
+    union fs_block indirect;
+    int indirect_loaded;
+    int indirect_dirty;
+    struct map_level level[LARGE_TREES]; // v3 path cache, one block per depth
+    unsigned gen;   // inode_gens value the map was loaded or saved under
+};
 
-    // write superblock
-    disk_write(0, block.data);
-    int inodes = block.super.ninodeblocks+1;
+// Growable list of block numbers gathered during a scan
+struct block_list
+{
+    int *blocks;
+    int count;
+    int size;
+};
 
-    for(int i=1; i < inodes; i++)
-    {	// access all inode blocks
-	disk_read(i, block.data);
-	for(int j=0; j < INODES_PER_BLOCK; j++)
-	{ // access all inodes
-	    block.inodes[j].isvalid = 0; // <-- access inode j in block i
-	    for (int k = 0; k < POINTERS_PER_INODE; k++)
-	    {
-		int direct = block.inodes[j].direct[k];
-		if (direct != 0)
-		{
-		    block.inodes[j].direct[k] = 0;
-		    union fs_block data_block;
-		    disk_read(direct, data_block.data);
-		    for (int m=0; m < DISK_BLOCK_SIZE; m++)
-		    {
-			data_block.data[m] = 0; // set all data to 0 in data block
-		    }
-		    disk_write(direct, data_block.data);
-		}
-		// set all direct pointers to 0
-	    }
+// One worker's share of the full inode table scan
+struct scan_job
+{
+    int first;      // first inode block to scan
+    int last;       // one past the last inode block
+    int nblocks;
+    uint64_t *used; // private bitmap of the blocks found
+    int ok;
+};
 
-	    // indirect pointers
-	    union fs_block indirect;
-	    if (block.inodes[j].indirect > 0)
-	    {
-		disk_read(block.inodes[j].indirect, indirect.data);
-		for (int m=0; m < POINTERS_PER_BLOCK; m++)
-		{
-		    if (indirect.pointers[m] > 0)
-		    {
-			union fs_block pointer;
-			disk_read(indirect.pointers[m], pointer.data);
-			for (int n=0; n < DISK_BLOCK_SIZE; n++)
-			{
-			    pointer.data[n] = 0;
-			}
-			disk_write(indirect.pointers[m], pointer.data);
-			indirect.pointers[m] = 0;
-		    }
-		}
-		disk_write(block.inodes[j].indirect, indirect.data);
-		block.inodes[j].indirect = 0;
-		
-	    }
-	}
-	disk_write(i, block.data);
-    }
+// Blocks prefetched for a sequential reader, possibly still in flight
+struct ra_window
+{
+    int first;      // first file block held
+    int count;      // 0 when empty
+    char *buf;
+    struct disk_request *reqs;
+    int nreqs;
+    int pending;    // reqs not waited for yet
+};
 
-    return 1;
-}
+// Sequential access detection and readahead for one inode
+struct fs_stream
+{
+    int inumber;     // 0 when unused
+    long next_offset; // where a sequential reader continues
+    int window;      // size of the last window, 0 after a random read
+    int newest;      // slot holding the window furthest ahead
+    struct ra_window win[2];
+    pthread_mutex_t lock;
+};
 
-/* scans a mounted filesystem and repot on how the inodes and blocks are organized */
-void fs_debug()
+// Buffered writes to one inode, not allocated on disk yet
+struct fs_dirty
 {
-    union fs_block block;
+    int inumber;    // 0 when unused
+    int first;      // first file block buffered
+    int count;      // blocks buffered
+    long end;       // byte offset one past the last byte written
+    int reserved;   // blocks promised to the flush: data, pointer slack and extent gap
+    char *buf;
+    pthread_mutex_t lock;
+};
 
-    disk_read(0,block.data);
+// A name looked up recently, keyed by its directory and the name
+struct fs_dentry
+{
+    int parent;     // 0 when unused
+    int inumber;
+    unsigned gen;   // generation of the inode the name was made for
+    char name[FS_NAME_MAX + 1];
+};
 
-    printf("superblock:\n");
-	
-    // check if magic number valid
-    if (block.super.magic == FS_MAGIC) 
-    {
-	printf("    magic number is valid\n");
-    } 
-    else 
-    {
-	printf("    magic number is not valid\n");
-    }
+// An open file: its map kept from call to call, and a cursor
+struct fs_file
+{
+    int inumber;
+    long offset;
+    struct fs_map map;
+};
 
-    printf("    %d blocks on disk\n",block.super.nblocks);
-    printf("    %d blocks for inodes\n",block.super.ninodeblocks);
-    printf("    %d inodes total\n",block.super.ninodes);
+/* GLOBALS ------------------------------------------------------------------ */
 
-    int i; // increments through all blocks
-    int inodes = block.super.ninodeblocks+1;
+static struct Disk disk;
+static struct fs_superblock super; // copy of block 0 while mounted
+static union fs_block **itable;    // inode blocks, loaded on first use
+static char *itable_dirty;
+static uint64_t *ifree;         // free inodes, one bit each
+static int *ifree_count;        // free inodes per inode block, -1 if not yet known
+static uint64_t *ifree_blocks;  // inode blocks that may have a free inode
+static int ifree_hint;          // first inode block worth looking at
+static uint64_t *bitmap;
+static char *bitmap_dirty;
+static uint64_t *bitmap_pending; // released since the last commit, still set in bitmap
+static int npending;
+static int bitmap_words;
+static int nfree;       // free blocks, kept in step with the bitmap
+static int alloc_hint;  // where the next-fit allocation scan resumes
+static int mount_threads = 0; // scan threads for fs_mount, 0 for one per CPU
+static struct fs_stream streams[RA_STREAMS] = { [0 ... RA_STREAMS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } }; // readahead, by inumber % RA_STREAMS
+static struct fs_dirty dirty[DIRTY_SLOTS] = { [0 ... DIRTY_SLOTS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } };  // write-behind, by inumber % DIRTY_SLOTS
+static int reserved;    // free blocks promised to buffered writes
+static __thread int spend_reserved; // of those, how many the calling thread's flush may take
+static __thread int spent_block;    // the calling thread's last allocation if it came out of spend_reserved, else 0
+static struct fs_dentry dcache[DCACHE_SLOTS]; // names, by directory and name hash
 
-    // look through inode blocks
-    for (i=1; i < inodes; i++)
-    {
-	disk_read(i, block.data);
-	for (int j = 0; j < INODES_PER_BLOCK; j++)
-	{
-	    
-	    if(block.inodes[j].isvalid)
-	    {
-		printf("inode %d:\n", j+(INODES_PER_BLOCK)*(i-1));
-		printf("    size: %d\n", block.inodes[j].size);
-		printf("    direct blocks:");
-		
-		for (int k=0; k < POINTERS_PER_INODE; k++)
-		{
-		    if (block.inodes[j].direct[k] != 0)
-		    {
-			printf(" %d", block.inodes[j].direct[k]);
-		    }
-		}
-		printf("\n");
+/*
+fs_read, fs_write, fs_create, fs_delete, fs_getsize, fs_fsync and the
+path calls may be called from several threads at once; format, mount,
+unmount and debug may not. An inode is read under its reader/writer lock
+and changed under it exclusively. Locks are taken in this order, and
+only trylock goes against it: namespace, commit (shared), inode, dirty
+slot, stream, then the leaf locks (itable, ifree, alloc) and finally the
+cache.
+*/
+static pthread_mutex_t namespace_lock = PTHREAD_MUTEX_INITIALIZER; // every directory and the dentry cache
+static pthread_rwlock_t inode_locks[INODE_LOCKS] = { [0 ... INODE_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER };
+static unsigned inode_gens[INODE_LOCKS]; // bumped whenever an inode under that lock changes, so kept maps know to reload
+static pthread_mutex_t itable_lock = PTHREAD_MUTEX_INITIALIZER; // itable loading and itable_dirty
+static pthread_mutex_t ifree_lock = PTHREAD_MUTEX_INITIALIZER;  // the free inode index
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;  // bitmap, the pending frees, nfree, alloc_hint and reserved
+static pthread_rwlock_t commit_lock; // shared by every call, exclusive for a commit
+static pthread_once_t commit_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t txn_lock = PTHREAD_MUTEX_INITIALIZER;    // txn_depth, txn_ops and the timer
+static pthread_cond_t txn_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t txn_thread;
+static int txn_running; // the commit timer is up
+static int txn_depth;   // fs_begin calls still open
+static int txn_ops;     // changes since the last commit
 
-		union fs_block indirect;
-		if (block.inodes[j].indirect > 0)
-		{
-		    printf("	indirect block: %d\n", block.inodes[j].indirect);
+/* FUNCTIONS ---------------------------------------------------------------- */
 
-		    // read indirect block data
-		    printf("	indirect data blocks:");
-		    disk_read(block.inodes[j].indirect, indirect.data);
-		    for (int m=0; m < POINTERS_PER_BLOCK; m++)
-		    {
-			if (indirect.pointers[m] > 0)
-			{
-			    printf(" %d", indirect.pointers[m]);
-			}
-		    }
-		    printf("\n");
-		}
-	    }
-	}
+/* a buffer of count blocks, page aligned so O_DIRECT can move it without a bounce; 0 if out of memory */
+static char *block_alloc( int count )
+{
+    char *buf;
+    if (posix_memalign((void **)&buf, DISK_BLOCK_SIZE, (size_t)count * DISK_BLOCK_SIZE))
+    {
+	return 0;
     }
+    return buf;
 }
 
-/* examine the disk for a filesystem, build a free block bitmap, prepare the filesystem for use */
-int fs_mount()
+/*
+In-memory inode table. Inode blocks are loaded on first use and then
+served from memory; changes only mark the block dirty, and inode_sync()
+writes the dirty blocks back whole.
+*/
+static int itable_init( int ninodeblocks )
 {
-    union fs_block block;
-    
-    // check if already mounted
-    if (disk.mounted) 
+    itable = calloc(ninodeblocks, sizeof(union fs_block *));
+    itable_dirty = calloc(ninodeblocks, 1);
+    if (!itable || !itable_dirty)
     {
-	printf("File system already mounted\n");
+	free(itable);
+	free(itable_dirty);
+	itable = 0;
+	itable_dirty = 0;
 	return 0;
     }
+    return 1;
+}
 
-    disk_read(0, block.data); // read superblock
-
-    // check for correct magic number
-    if (block.super.magic != FS_MAGIC)
+static void itable_free()
+{
+    for (int i = 0; itable && i < super.ninodeblocks; i++)
     {
-	printf("Invalid Magic Number\n");
-	return 0;
+	free(itable[i]);
     }
+    free(itable);
+    free(itable_dirty);
+    itable = 0;
+    itable_dirty = 0;
+}
 
-    int nblocks = block.super.nblocks;
-    // create free block bitmap
-    bitmap = malloc(nblocks*sizeof(int));
-    int inodes = block.super.ninodeblocks+1;
-    for(int i=0; i < inodes; i++)
+/* the cached inode for inumber, or null if the number is out of range */
+static struct fs_inode *inode_get( int inumber )
+{
+    if (inumber < 0 || inumber >= super.ninodes)
     {
-	bitmap[i] = 1; // superblock and inode blocks filled
+	return 0;
     }
 
-    for(int i=1; i < inodes; i++)
+    int i = inumber / INODES_PER_BLOCK;
+    pthread_mutex_lock(&itable_lock);
+    union fs_block *block = itable[i];
+    if (!block && (block = malloc(sizeof(union fs_block))))
     {
-	disk_read(i, block.data);
-	for (int j=0; j < INODES_PER_BLOCK; j++)
-	{
-	    if (block.inodes[j].isvalid)
-	    {
-		for (int k=0; k < POINTERS_PER_INODE; k++)
-		{
-		    if (block.inodes[j].direct[k] > 0)
-		    {
-			bitmap[block.inodes[j].direct[k]] = 1;
-		    }
-		}
-
-		// indirection
-		union fs_block indirect;
-		if (block.inodes[j].indirect > 0)
-		{
-		    bitmap[block.inodes[j].indirect] = 1;
-		    disk_read(block.inodes[j].indirect, indirect.data);
-		    for (int m=0; m < POINTERS_PER_BLOCK; m++)
-		    {
-			if (indirect.pointers[m] > 0)
-			{
-			    bitmap[indirect.pointers[m]] = 1;
-			}
-		    }
-		}
-	    }
-	}
+	cache_read(i + 1, block->data);
+	itable[i] = block;
     }
+    pthread_mutex_unlock(&itable_lock);
+    return block ? &block->inodes[inumber % INODES_PER_BLOCK] : 0;
+}
 
-    disk.mounted = 1; 
-    return 1;
+static void inode_dirty( int inumber )
+{
+    pthread_mutex_lock(&itable_lock);
+    itable_dirty[inumber / INODES_PER_BLOCK] = 1;
+    pthread_mutex_unlock(&itable_lock);
 }
 
-/* create a new inode of zero length, returns number of inode */
-int fs_create()
+/* the lock guarding inumber, shared with every inumber that has the same remainder */
+static pthread_rwlock_t *inode_lock( int inumber )
 {
-    union fs_block block;
-    disk_read(0, block.data);
-    int inodes = block.super.ninodeblocks;
-    int node = 0;
-    int blck = 0;
-    
-    for (int i=1; i < inodes+1; i++)
+    return &inode_locks[(unsigned)inumber % INODE_LOCKS];
+}
+
+/* write every changed inode block back into the block cache */
+static void inode_sync()
+{
+    for (int i = 0; itable && i < super.ninodeblocks; i++)
     {
-	blck = i;
-	disk_read(i, block.data);
-	for (int j=0; j < INODES_PER_BLOCK; j++)
-	{
-	    if (!block.inodes[j].isvalid)
-	    {
-		node = j+(INODES_PER_BLOCK)*(i-1);
-		if(node == 0 && i == 1)
-		{
-		    continue;
-		}
-		break;
-	    }
-	}
-	
-	if (node != 0)
+	if (itable_dirty[i])
 	{
-	    break;
+	    cache_write_meta(i + 1, itable[i]->data);
+	    itable_dirty[i] = 0;
 	}
     }
+}
 
+/*
+Free inode index. One bit per inode marks it free, each inode block
+keeps a count of its free inodes (-1 until the block has been looked
+at), and a summary bit per inode block says whether it may still have
+a free inode. fs_create finds a slot by scanning the summary words from
+a hint, so it only ever touches the one inode block it allocates from.
+*/
+static void ifree_free();
+
+static int ifree_init( int ninodeblocks )
+{
+    int summary_words = (ninodeblocks + 63) / 64;
 
-    if (node == 0)
+    ifree_free();
+    ifree = calloc((size_t)ninodeblocks * IFREE_WORDS, sizeof(uint64_t));
+    ifree_count = malloc(ninodeblocks * sizeof(int));
+    ifree_blocks = calloc(summary_words, sizeof(uint64_t));
+    if (!ifree || !ifree_count || !ifree_blocks)
     {
-	// all nodes occupied
+	ifree_free();
 	return 0;
     }
 
-    // initilize inode
-    block.inodes[node].isvalid = 1;
-    block.inodes[node].size = 0;
-    
-    for (int i=0; i < POINTERS_PER_INODE; i++)
+    for (int i = 0; i < ninodeblocks; i++)
     {
-	block.inodes[node].direct[i] = 0;
-    
-	// Indirection
-	block.inodes[node].indirect = 0;
+	ifree_count[i] = -1;
+	ifree_blocks[i / 64] |= 1ULL << (i % 64);
     }
-    disk_write(blck, block.data);
+    ifree_hint = 0;
+    return 1;
+}
+
+static void ifree_free()
+{
+    free(ifree);
+    free(ifree_count);
+    free(ifree_blocks);
+    ifree = 0;
+    ifree_count = 0;
+    ifree_blocks = 0;
+}
 
-    printf("node: %d\n", node);
+/* record which inodes of inode block i are free; safe to run on distinct blocks in parallel */
+static void ifree_scan_block( int i, union fs_block *block )
+{
+    uint64_t *words = &ifree[(size_t)i * IFREE_WORDS];
+    int count = 0;
 
-    return node;
+    memset(words, 0, IFREE_WORDS * sizeof(uint64_t));
+    for (int j = 0; j < INODES_PER_BLOCK; j++)
+    {
+	// inode 0 is reserved
+	if (!(block->inodes[j].isvalid & INODE_TYPE) && (i || j))
+	{
+	    words[j / 64] |= 1ULL << (j % 64);
+	    count++;
+	}
+    }
+    ifree_count[i] = count;
 }
 
-/* delete the inode indicated by the number */
-int fs_delete( int inumber )
+/* refresh the summary bit of inode block i from its count */
+static void ifree_summarize( int i )
 {
-    union fs_block block;
-    disk_read(0, block.data);
-    if (inumber > block.super.ninodes)
+    if (ifree_count[i])
     {
-	return 0;
+	ifree_blocks[i / 64] |= 1ULL << (i % 64);
+    }
+    else
+    {
+	ifree_blocks[i / 64] &= ~(1ULL << (i % 64));
     }
+}
+
+/* note that inumber has just been freed */
+static void ifree_release( int inumber )
+{
+    int i = inumber / INODES_PER_BLOCK;
+    int j = inumber % INODES_PER_BLOCK;
 
-    int nblock = 1;
-    while (inumber > INODES_PER_BLOCK)
+    // a block nobody has counted yet will find it when it is scanned
+    if (ifree_count[i] < 0)
     {
-	nblock++;
+	return;
     }
 
-    disk_read(nblock, block.data);
-    if(!block.inodes[inumber].isvalid)
+    ifree[(size_t)i * IFREE_WORDS + j / 64] |= 1ULL << (j % 64);
+    ifree_count[i]++;
+    ifree_summarize(i);
+    if (i < ifree_hint)
     {
-	return 0;
+	ifree_hint = i;
     }
+}
 
-    block.inodes[inumber].isvalid = 0;
-    for (int k=0; k < POINTERS_PER_INODE; k++)
+/* claim a free inode number, 0 if every inode is in use */
+static int ifree_take()
+{
+    int summary_words = (super.ninodeblocks + 63) / 64;
+
+    for (int w = ifree_hint / 64; w < summary_words; w++)
     {
-	if(block.inodes[inumber].direct[k] > 0)
+	uint64_t candidates = ifree_blocks[w];
+	if (w == ifree_hint / 64)
 	{
-	    int direct = block.inodes[inumber].direct[k];
-	    bitmap[direct] = 0;
+	    candidates &= ~0ULL << (ifree_hint % 64);
 	}
-    
-	if(block.inodes[inumber].indirect > 0)
+
+	while (candidates)
 	{
-	    union fs_block indirect;
-	    disk_read(block.inodes[inumber].indirect, indirect.data);
-	    for (int j=0; j < POINTERS_PER_BLOCK; j++)
+	    int i = w * 64 + __builtin_ctzll(candidates);
+	    candidates &= candidates - 1;
+
+	    if (ifree_count[i] < 0)
+	    {
+		if (!inode_get(i * INODES_PER_BLOCK))
+		{
+		    return 0;
+		}
+		ifree_scan_block(i, itable[i]);
+	    }
+
+	    ifree_hint = i;
+	    for (int k = 0; ifree_count[i] > 0 && k < IFREE_WORDS; k++)
 	    {
-		int ptr = indirect.pointers[j];
-		if (ptr > 0) 
+		uint64_t *word = &ifree[(size_t)i * IFREE_WORDS + k];
+		if (*word)
 		{
-		    bitmap[ptr] = 0;
+		    int j = k * 64 + __builtin_ctzll(*word);
+		    *word &= *word - 1;
+		    ifree_count[i]--;
+		    ifree_summarize(i);
+		    return i * INODES_PER_BLOCK + j;
 		}
-		indirect.pointers[j] = 0;
 	    }
-	    disk_write(block.inodes[inumber].indirect, indirect.data);
+	    ifree_summarize(i);
 	}
     }
-    
-    disk_write(nblock, block.data);
 
-    return 1;
+    return 0;
 }
 
-/* return the logical size of of the given inode (bytes) */
-int fs_getsize( int inumber )
+/* load the inode for inumber along with an empty indirect block slot */
+static int map_load( struct fs_map *map, int inumber )
 {
-    union fs_block block;
-    disk_read(0, block.data);
-    if (inumber > block.super.ninodes)
+    struct fs_inode *inode = inode_get(inumber);
+    if (!inode)
     {
-	return -1;
+	return 0;
     }
 
-    int nblock = 1;
-    while (inumber > INODES_PER_BLOCK)
+    map->inumber = inumber;
+    map->inode = *inode;
+    map->gen = inode_gens[(unsigned)inumber % INODE_LOCKS];
+    map->indirect_loaded = 0;
+    map->indirect_dirty = 0;
+    for (int d = 0; d < LARGE_TREES; d++)
     {
-	nblock++;
+	map->level[d].blocknum = 0;
+	map->level[d].dirty = 0;
+    }
+    return 1;
+}
+
+/* reload a kept map if its inode changed since, or if it was never loaded; the caller holds the inode lock */
+static int map_refresh( struct fs_map *map, int inumber )
+{
+    if (map->inumber == inumber && map->gen == inode_gens[(unsigned)inumber % INODE_LOCKS])
+    {
+	return 1;
+    }
+    map->inumber = 0;
+    return map_load(map, inumber);
+}
+
+/* size of an inode in bytes; only v3 inodes have an upper half */
+static long inode_size( const struct fs_inode *inode )
+{
+    if (disk.large)
+    {
+	return (long)inode->size_hi << 32 | (unsigned)inode->size;
+    }
+    return inode->size;
+}
+
+static void inode_set_size( struct fs_inode *inode, long size )
+{
+    inode->size = (int)size;
+    if (disk.large)
+    {
+	inode->size_hi = (int)(size >> 32);
+    }
+}
+
+/* disk block of the indirect (v1) or extent overflow (v2) block, 0 if none */
+static int map_indirect_block( struct fs_map *map )
+{
+    return disk.extents ? map->inode.overflow : map->inode.indirect;
+}
+
+static void map_load_indirect( struct fs_map *map )
+{
+    if (!map->indirect_loaded)
+    {
+	stats_set_class(map_indirect_block(map), 1, STATS_INDIRECT);
+	cache_read(map_indirect_block(map), map->indirect.data);
+	map->indirect_loaded = 1;
+    }
+}
+
+/* write back the inode and, if they changed, the indirect or pointer blocks */
+static void map_save( struct fs_map *map )
+{
+    if (map->indirect_dirty)
+    {
+	stats_set_class(map_indirect_block(map), 1, STATS_INDIRECT);
+	cache_write_meta(map_indirect_block(map), map->indirect.data);
+	map->indirect_dirty = 0;
+    }
+    for (int d = 0; d < LARGE_TREES; d++)
+    {
+	if (map->level[d].dirty)
+	{
+	    cache_write_meta(map->level[d].blocknum, map->level[d].block.data);
+	    map->level[d].dirty = 0;
+	}
+    }
+
+    *inode_get(map->inumber) = map->inode;
+    inode_dirty(map->inumber);
+    map->gen = ++inode_gens[(unsigned)map->inumber % INODE_LOCKS];
+}
+
+/* largest number of blocks a file can map */
+static int map_max_blocks()
+{
+    if (disk.extents)
+    {
+	return INT_MAX / DISK_BLOCK_SIZE;
+    }
+    if (disk.large)
+    {
+	return LARGE_DIRECT + POINTERS_PER_BLOCK + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK
+	    + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+    }
+    return POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+}
+
+/* extent k of a v2 inode, reading the overflow block if k lives there */
+static struct fs_extent *map_extent( struct fs_map *map, int k )
+{
+    if (k < EXTENTS_PER_INODE)
+    {
+	return &map->inode.extents[k];
+    }
+    map_load_indirect(map);
+    return &map->indirect.extents[k - EXTENTS_PER_INODE];
+}
+
+/* number of file blocks covered by the extents of a v2 inode */
+static int map_extent_blocks( struct fs_map *map )
+{
+    int total = 0;
+    for (int k = 0; k < map->inode.nextents; k++)
+    {
+	total += map_extent(map, k)->length;
+    }
+    return total;
+}
+
+static int alloc_near( int goal );
+
+/* pointer block blocknum, held in the path slot for depth d so repeated walks do not read it again */
+static union fs_block *map_level( struct fs_map *map, int d, int blocknum, int fresh )
+{
+    struct map_level *level = &map->level[d];
+    if (level->blocknum != blocknum || fresh)
+    {
+	if (level->dirty)
+	{
+	    cache_write_meta(level->blocknum, level->block.data);
+	}
+	stats_set_class(blocknum, 1, STATS_INDIRECT);
+	if (fresh)
+	{
+	    memset(level->block.data, 0, DISK_BLOCK_SIZE);
+	}
+	else
+	{
+	    cache_read(blocknum, level->block.data);
+	}
+	level->blocknum = blocknum;
+	level->dirty = fresh;
+    }
+    return &level->block;
+}
+
+/*
+Find the pointer slot for file block fblock in a v3 inode, walking down
+its direct pointers or one of its trees. Each depth costs at most one
+block read, and none when the path cache already holds that block.
+With goal null a missing pointer block ends the walk (null is returned);
+otherwise missing blocks are allocated near *goal, which is moved past
+them. depth is set to the level whose block holds the slot, -1 for the
+inode itself.
+*/
+static int *map_tree_slot( struct fs_map *map, int fblock, int *goal, int *depth )
+{
+    *depth = -1;
+    if (fblock < LARGE_DIRECT)
+    {
+	return &map->inode.blocks[fblock];
+    }
+
+    // pick the tree and the index within it
+    long index = fblock - LARGE_DIRECT;
+    long span = POINTERS_PER_BLOCK;
+    int t = 0;
+    while (index >= span)
+    {
+	index -= span;
+	span *= POINTERS_PER_BLOCK;
+	if (++t == LARGE_TREES)
+	{
+	    return 0;
+	}
+    }
+
+    int *slot = &map->inode.tree[t];
+    for (int d = 0; d <= t; d++)
+    {
+	int fresh = 0;
+	if (*slot <= 0 || *slot >= disk.nblocks)
+	{
+	    if (!goal || !(*slot = alloc_near(*goal)))
+	    {
+		return 0;
+	    }
+	    *goal = *slot + 1;
+	    fresh = 1;
+	    if (*depth >= 0)
+	    {
+		map->level[*depth].dirty = 1;
+	    }
+	}
+
+	union fs_block *block = map_level(map, d, *slot, fresh);
+	span /= POINTERS_PER_BLOCK;
+	slot = &block->pointers[index / span];
+	index %= span;
+	*depth = d;
+    }
+    return slot;
+}
+
+static int map_run( struct fs_map *map, int fblock, int limit, int *run );
+
+/* return the disk block holding file block fblock, or 0 if it is not mapped */
+static int map_block( struct fs_map *map, int fblock )
+{
+    if (disk.extents)
+    {
+	int run;
+	return map_run(map, fblock, 1, &run);
+    }
+    if (disk.large)
+    {
+	int depth;
+	int *slot = map_tree_slot(map, fblock, 0, &depth);
+	return slot ? *slot : 0;
+    }
+
+    if (fblock < POINTERS_PER_INODE)
+    {
+	return map->inode.direct[fblock];
+    }
+
+    fblock -= POINTERS_PER_INODE;
+    if (fblock >= POINTERS_PER_BLOCK || map->inode.indirect <= 0)
+    {
+	return 0;
+    }
+
+    map_load_indirect(map);
+    return map->indirect.pointers[fblock];
+}
+
+/*
+Map file block fblock and tell the caller, through run, how many of the
+following file blocks (at most limit) sit right after it on disk. An
+unmapped block returns 0 with a run of 1. For extent inodes this is a
+single walk of the extent list.
+*/
+static int map_run( struct fs_map *map, int fblock, int limit, int *run )
+{
+    *run = 1;
+
+    if (disk.extents)
+    {
+	int base = 0;
+	for (int k = 0; k < map->inode.nextents; k++)
+	{
+	    struct fs_extent *ext = map_extent(map, k);
+	    if (fblock < base + ext->length)
+	    {
+		int left = base + ext->length - fblock;
+		*run = left < limit ? left : limit;
+		return ext->start + fblock - base;
+	    }
+	    base += ext->length;
+	}
+	return 0;
+    }
+
+    int start = map_block(map, fblock);
+    while (start && *run < limit && map_block(map, fblock + *run) == start + *run)
+    {
+	(*run)++;
+    }
+    return start;
+}
+
+/*
+Free block bitmap, one bit per block packed into 64-bit words. Set bits
+are in use; the padding bits past the last block are kept set so the
+word scan never hands them out. The same words are stored on disk in
+the bitmap region after the inode table, one block per BITS_PER_BLOCK
+blocks, and bitmap_dirty tracks which of those blocks need writing.
+Blocks an inode on disk may still point at are not cleared right away
+but collect in bitmap_pending until the commit that drops the pointers.
+*/
+static void bitmap_free()
+{
+    free(bitmap);
+    free(bitmap_dirty);
+    free(bitmap_pending);
+    bitmap = 0;
+    bitmap_dirty = 0;
+    bitmap_pending = 0;
+    npending = 0;
+}
+
+static int bitmap_init( int nblocks, int nbitmapblocks )
+{
+    size_t words = (size_t)nbitmapblocks * DISK_BLOCK_SIZE / sizeof(uint64_t);
+
+    bitmap_words = (nblocks + 63) / 64;
+    if (words < bitmap_words)
+    {
+	words = bitmap_words;
+    }
+
+    bitmap_free();
+    // the saved bitmap is read straight into it
+    bitmap = (uint64_t *)block_alloc((words * sizeof(uint64_t) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE);
+    bitmap_dirty = calloc(nbitmapblocks + 1, 1);
+    bitmap_pending = calloc(words, sizeof(uint64_t));
+    if (!bitmap || !bitmap_dirty || !bitmap_pending)
+    {
+	bitmap_free();
+	return 0;
+    }
+    memset(bitmap, 0, words * sizeof(uint64_t));
+    if (nblocks % 64)
+    {
+	bitmap[bitmap_words - 1] = ~0ULL << (nblocks % 64);
+    }
+    nfree = nblocks;
+    alloc_hint = 0;
+    return 1;
+}
+
+/* number of bitmap blocks a superblock describes, 0 for images without a bitmap region */
+static int bitmap_region( struct fs_superblock *super )
+{
+    int expected = (super->nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    return super->nbitmapblocks == expected ? expected : 0;
+}
+
+/* push the changed parts of the bitmap into the cache */
+static void bitmap_sync()
+{
+    pthread_mutex_lock(&alloc_lock);
+    for (int i = 0; i < disk.nbitmapblocks; i++)
+    {
+	if (bitmap_dirty[i])
+	{
+	    cache_write_meta(disk.bitmap_start + i, (char *)bitmap + (size_t)i * DISK_BLOCK_SIZE);
+	    bitmap_dirty[i] = 0;
+	}
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/* recompute the free counter from the words after a bulk update */
+static void bitmap_count()
+{
+    nfree = 0;
+    for (int w = 0; w < bitmap_words; w++)
+    {
+	nfree += 64 - __builtin_popcountll(bitmap[w]);
+    }
+}
+
+static int bitmap_test( int blocknum )
+{
+    return (bitmap[blocknum / 64] >> (blocknum % 64)) & 1;
+}
+
+static void bitmap_set( int blocknum )
+{
+    if (!bitmap_test(blocknum))
+    {
+	bitmap[blocknum / 64] |= 1ULL << (blocknum % 64);
+	bitmap_dirty[blocknum / BITS_PER_BLOCK] = 1;
+	nfree--;
+    }
+}
+
+static void bitmap_clear( int blocknum )
+{
+    pthread_mutex_lock(&alloc_lock);
+    if (blocknum > 0 && blocknum < disk.nblocks && bitmap_test(blocknum))
+    {
+	bitmap[blocknum / 64] &= ~(1ULL << (blocknum % 64));
+	bitmap_dirty[blocknum / BITS_PER_BLOCK] = 1;
+	nfree++;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+release a block that an inode on disk may still point at. It stays in
+use until bitmap_settle runs after the next commit, so a crash before
+then cannot find it both in the deleted file and in a new one.
+*/
+static void bitmap_release( int blocknum )
+{
+    pthread_mutex_lock(&alloc_lock);
+    if (blocknum > 0 && blocknum < disk.nblocks && bitmap_test(blocknum)
+	    && !(bitmap_pending[blocknum / 64] >> (blocknum % 64) & 1))
+    {
+	bitmap_pending[blocknum / 64] |= 1ULL << (blocknum % 64);
+	npending++;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/* free the released blocks once the commit that dropped them is on disk, returns how many */
+static int bitmap_settle()
+{
+    pthread_mutex_lock(&alloc_lock);
+    int settled = npending;
+    for (int w = 0; npending && w < bitmap_words; w++)
+    {
+	if (bitmap_pending[w])
+	{
+	    int n = __builtin_popcountll(bitmap_pending[w]);
+	    bitmap[w] &= ~bitmap_pending[w];
+	    bitmap_dirty[w * 64 / BITS_PER_BLOCK] = 1;
+	    bitmap_pending[w] = 0;
+	    nfree += n;
+	    npending -= n;
+	}
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return settled;
+}
+
+/* take the first free block at or after start, wrapping around; 0 if the disk is full */
+static int alloc_from( int start )
+{
+    // blocks promised to buffered writes are only handed to the flush they were promised to
+    if (nfree == 0 || (spend_reserved == 0 && nfree <= reserved))
+    {
+	return 0;
+    }
+
+    int first = start / 64;
+    for (int n = 0; n <= bitmap_words; n++)
+    {
+	int w = (first + n) % bitmap_words;
+	uint64_t free_bits = ~bitmap[w];
+	if (n == 0)
+	{
+	    // only bits at or after start on the first pass over this word
+	    free_bits &= ~0ULL << (start % 64);
+	}
+	if (free_bits)
+	{
+	    int blocknum = w * 64 + __builtin_ctzll(free_bits);
+	    bitmap_set(blocknum);
+	    alloc_hint = blocknum + 1 < disk.nblocks ? blocknum + 1 : 0;
+	    spent_block = spend_reserved > 0 ? blocknum : 0;
+	    if (spend_reserved > 0)
+	    {
+		spend_reserved--;
+		reserved--;
+	    }
+	    return blocknum;
+	}
+    }
+    return 0;
+}
+
+/* give back a block alloc_near just handed out and never used, and the reservation it was taken from */
+static void alloc_undo( int blocknum )
+{
+    bitmap_clear(blocknum);
+    if (blocknum == spent_block)
+    {
+	pthread_mutex_lock(&alloc_lock);
+	spend_reserved++;
+	reserved++;
+	pthread_mutex_unlock(&alloc_lock);
+	spent_block = 0;
+    }
+}
+
+/* take the next free block after the last allocation (next fit), 0 if the disk is full */
+static int alloc_block()
+{
+    return alloc_from(alloc_hint);
+}
+
+/* take goal if it is free, otherwise the closest free block after it, so files stay contiguous */
+static int alloc_near( int goal )
+{
+    pthread_mutex_lock(&alloc_lock);
+    int b = goal > 0 && goal < disk.nblocks ? alloc_from(goal) : alloc_block();
+    pthread_mutex_unlock(&alloc_lock);
+
+    // data until the caller says it holds pointers
+    stats_set_class(b, 1, STATS_DATA);
+    return b;
+}
+
+/* first block of a run of count free blocks inside [from, to), 0 if there is none */
+static int free_run_in( int from, int to, int count )
+{
+    int b = from;
+    while (b < to)
+    {
+	// skip whole words of used blocks, then find where the free stretch ends the same way
+	uint64_t free_bits = ~bitmap[b / 64] & (~0ULL << (b % 64));
+	if (!free_bits)
+	{
+	    b = (b / 64 + 1) * 64;
+	    continue;
+	}
+	b = b / 64 * 64 + __builtin_ctzll(free_bits);
+
+	int end = b;
+	while (end < to && end - b < count)
+	{
+	    uint64_t used = bitmap[end / 64] & (~0ULL << (end % 64));
+	    if (used)
+	    {
+		end = end / 64 * 64 + __builtin_ctzll(used);
+		break;
+	    }
+	    end = (end / 64 + 1) * 64;
+	}
+	if ((end < to ? end : to) - b >= count)
+	{
+	    return b;
+	}
+	b = end;
+    }
+    return 0;
+}
+
+/*
+first block of a run of count free blocks at or after goal (the next
+fit position for 0, wrapping around), 0 if there is none. Nothing is
+taken, so another thread may still get there first.
+*/
+static int find_free_run( int goal, int count )
+{
+    pthread_mutex_lock(&alloc_lock);
+    int p = goal > 0 && goal < disk.nblocks ? goal : alloc_hint;
+    // a run does not wrap past the end of the disk
+    int start = free_run_in(p, disk.nblocks, count);
+    if (!start)
+    {
+	start = free_run_in(0, p + count - 1 < disk.nblocks ? p + count - 1 : disk.nblocks, count);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return start;
+}
+
+/* append one block to a v2 inode near goal (0 for the end of the last extent), growing the last extent when the allocator allows */
+static int map_alloc_extent( struct fs_map *map, int goal )
+{
+    struct fs_extent *last = 0;
+    int end = 0;
+
+    if (map->inode.nextents > 0)
+    {
+	last = map_extent(map, map->inode.nextents - 1);
+	end = last->start + last->length;
+    }
+
+    int b = alloc_near(goal ? goal : end);
+    if (!b)
+    {
+	return 0;
+    }
+    if (last && b == end)
+    {
+	last->length++;
+	map->indirect_dirty |= map->inode.nextents > EXTENTS_PER_INODE;
+	return b;
+    }
+
+    int k = map->inode.nextents;
+    if (k - EXTENTS_PER_INODE >= EXTENTS_PER_BLOCK)
+    {
+	alloc_undo(b);
+	return 0;
+    }
+    if (k == EXTENTS_PER_INODE)
+    {
+	// put the overflow block first so the new extent can keep growing after it
+	alloc_undo(b);
+	int overflow = alloc_near(b);
+	if (!overflow)
+	{
+	    return 0;
+	}
+	map->inode.overflow = overflow;
+	memset(map->indirect.data, 0, DISK_BLOCK_SIZE);
+	map->indirect_loaded = 1;
+	b = alloc_near(overflow + 1);
+	if (!b)
+	{
+	    alloc_undo(overflow);
+	    map->inode.overflow = 0;
+	    return 0;
+	}
+    }
+
+    struct fs_extent *ext = map_extent(map, k);
+    ext->start = b;
+    ext->length = 1;
+    map->inode.nextents++;
+    map->indirect_dirty |= k >= EXTENTS_PER_INODE;
+    return b;
+}
+
+/*
+give file block fblock a fresh disk block near goal, adding an indirect
+block if needed. A goal of 0 aims for the block right after the
+previous one in the file.
+*/
+static int map_alloc( struct fs_map *map, int fblock, int goal )
+{
+    if (disk.extents)
+    {
+	// extents only grow at the end of the file
+	return fblock == map_extent_blocks(map) ? map_alloc_extent(map, goal) : 0;
+    }
+
+    int *slot;
+    if (!goal)
+    {
+	int prev = fblock > 0 ? map_block(map, fblock - 1) : 0;
+	goal = prev ? prev + 1 : 0;
+    }
+
+    if (disk.large)
+    {
+	int depth;
+	slot = map_tree_slot(map, fblock, &goal, &depth);
+	if (!slot)
+	{
+	    return 0;
+	}
+	if (depth >= 0)
+	{
+	    map->level[depth].dirty = 1;
+	}
+    }
+    else if (fblock < POINTERS_PER_INODE)
+    {
+	slot = &map->inode.direct[fblock];
+    }
+    else
+    {
+	if (fblock - POINTERS_PER_INODE >= POINTERS_PER_BLOCK)
+	{
+	    return 0;
+	}
+	if (map->inode.indirect <= 0)
+	{
+	    int indirect = alloc_near(goal);
+	    if (!indirect)
+	    {
+		return 0;
+	    }
+	    map->inode.indirect = indirect;
+	    memset(map->indirect.data, 0, DISK_BLOCK_SIZE);
+	    map->indirect_loaded = 1;
+	    goal = indirect + 1;
+	}
+	else
+	{
+	    map_load_indirect(map);
+	}
+	map->indirect_dirty = 1;
+	slot = &map->indirect.pointers[fblock - POINTERS_PER_INODE];
+    }
+
+    *slot = alloc_near(goal);
+    return *slot;
+}
+
+/* release a v3 tree of the given height (0 for a data block) and everything below it */
+static void map_free_tree( int blocknum, int height )
+{
+    if (blocknum <= 0 || blocknum >= disk.nblocks)
+    {
+	return;
+    }
+    if (height > 0)
+    {
+	union fs_block block;
+	cache_read(blocknum, block.data);
+	for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+	{
+	    map_free_tree(block.pointers[i], height - 1);
+	}
+    }
+    bitmap_release(blocknum);
+}
+
+/* release every block the inode maps, including its indirect, overflow or pointer blocks, as of the next commit */
+static void map_free( struct fs_map *map )
+{
+    if (disk.large)
+    {
+	for (int d = 0; d < LARGE_TREES; d++)
+	{
+	    map->level[d].blocknum = 0;
+	    map->level[d].dirty = 0;
+	}
+	for (int k = 0; k < LARGE_DIRECT; k++)
+	{
+	    bitmap_release(map->inode.blocks[k]);
+	    map->inode.blocks[k] = 0;
+	}
+	for (int t = 0; t < LARGE_TREES; t++)
+	{
+	    map_free_tree(map->inode.tree[t], t + 1);
+	    map->inode.tree[t] = 0;
+	}
+	return;
+    }
+
+    if (disk.extents)
+    {
+	for (int k = 0; k < map->inode.nextents; k++)
+	{
+	    struct fs_extent *ext = map_extent(map, k);
+	    for (int b = 0; b < ext->length; b++)
+	    {
+		bitmap_release(ext->start + b);
+	    }
+	}
+	bitmap_release(map->inode.overflow);
+	memset(&map->inode.extents, 0, sizeof(map->inode.extents));
+	map->inode.nextents = 0;
+	map->inode.overflow = 0;
+	map->indirect_dirty = 0;
+	return;
+    }
+
+    for (int k=0; k < POINTERS_PER_INODE; k++)
+    {
+	bitmap_release(map->inode.direct[k]);
+	map->inode.direct[k] = 0;
+    }
+
+    if (map->inode.indirect > 0)
+    {
+	for (int j=0; j < POINTERS_PER_BLOCK; j++)
+	{
+	    bitmap_release(map_block(map, POINTERS_PER_INODE + j));
+	}
+	bitmap_release(map->inode.indirect);
+	map->inode.indirect = 0;
+    }
+    map->indirect_dirty = 0;
+}
+
+
+/* append blocknum to a list if it is a plausible data block */
+static void list_add( struct block_list *list, int blocknum, int nblocks )
+{
+    if (blocknum <= 0 || blocknum >= nblocks)
+    {
+	return;
+    }
+    if (list->count == list->size)
+    {
+	int size = list->size ? list->size * 2 : 256;
+	int *blocks = realloc(list->blocks, size * sizeof(int));
+	if (!blocks)
+	{
+	    return;
+	}
+	list->blocks = blocks;
+	list->size = size;
+    }
+    list->blocks[list->count++] = blocknum;
+}
+
+/* append every plausible block of an extent to a list */
+static void list_add_extent( struct block_list *list, const struct fs_extent *ext, int nblocks )
+{
+    for (int b = 0; ext->start > 0 && b < ext->length && ext->start + b < nblocks; b++)
+    {
+	list_add(list, ext->start + b, nblocks);
+    }
+}
+
+/*
+Submit one request per run of adjacent blocks (capped at AIO_MAX_RUN so
+several requests are in flight) and wait for all of them. Block i of the
+list is transferred to or from buf + i * DISK_BLOCK_SIZE, or always from
+buf when shared is set.
+*/
+static void transfer_async( const int *blocks, int n, char *buf, int write, int shared )
+{
+    struct disk_request reqs[AIO_BATCH];
+    int nreqs = 0;
+    int run;
+
+    for (int i = 0; i < n; i += run)
+    {
+	run = 1;
+	while (i + run < n && run < AIO_MAX_RUN && blocks[i + run] == blocks[i] + run)
+	{
+	    run++;
+	}
+	reqs[nreqs].blocknum = blocks[i];
+	reqs[nreqs].count = run;
+	reqs[nreqs].write = write;
+	reqs[nreqs].data = shared ? buf : buf + (size_t)i * DISK_BLOCK_SIZE;
+	nreqs++;
+    }
+
+    disk_submit(reqs, nreqs);
+    disk_wait(reqs, nreqs);
+}
+
+/* read up to AIO_BATCH listed pointer blocks into buf */
+static void read_blocks_async( const int *blocks, int n, char *buf )
+{
+    for (int i = 0; i < n; i++)
+    {
+	stats_set_class(blocks[i], 1, STATS_INDIRECT);
+    }
+    transfer_async(blocks, n, buf, 0, 0);
+}
+
+/* read up to AIO_BATCH consecutive blocks into buf */
+static void read_range_async( int blocknum, int n, char *buf )
+{
+    int blocks[AIO_BATCH];
+    for (int i = 0; i < n; i++)
+    {
+	blocks[i] = blocknum + i;
+    }
+    transfer_async(blocks, n, buf, 0, 0);
+}
+
+/* overwrite the listed blocks from a zeroed buffer of AIO_MAX_RUN blocks */
+static void zero_blocks_async( const int *blocks, int n, char *zeros )
+{
+    for (int i = 0; i < n; i += AIO_BATCH)
+    {
+	transfer_async(blocks + i, n - i < AIO_BATCH ? n - i : AIO_BATCH, zeros, 1, 1);
+    }
+}
+
+/* zero every data, indirect and overflow block the old inode table points at */
+static int zero_old_blocks( int nblocks, int inodes, int old_extents, int old_large )
+{
+    struct block_list victims = { 0, 0, 0 };
+    struct block_list indirects = { 0, 0, 0 };
+    struct block_list upper[LARGE_TREES - 1] = { { 0, 0, 0 } }; // v3 pointer blocks of height 2 and up
+    char *batch = block_alloc(AIO_BATCH);
+    char *zeros = block_alloc(AIO_MAX_RUN);
+    if (!batch || !zeros)
+    {
+	free(batch);
+	free(zeros);
+	return 0;
+    }
+    memset(zeros, 0, (size_t)AIO_MAX_RUN * DISK_BLOCK_SIZE);
+
+    for (int i = 1; i < inodes; i += AIO_BATCH)
+    {
+	int n = inodes - i < AIO_BATCH ? inodes - i : AIO_BATCH;
+	read_range_async(i, n, batch);
+	for (int b = 0; b < n; b++)
+	{
+	    union fs_block *iblock = (union fs_block *)(batch + b * DISK_BLOCK_SIZE);
+	    for (int j = 0; j < INODES_PER_BLOCK; j++)
+	    {
+		struct fs_inode *inode = &iblock->inodes[j];
+		if (old_extents)
+		{
+		    for (int k = 0; k < EXTENTS_PER_INODE && k < inode->nextents; k++)
+		    {
+			list_add_extent(&victims, &inode->extents[k], nblocks);
+		    }
+		    list_add(&indirects, inode->overflow, nblocks);
+		    continue;
+		}
+		if (old_large)
+		{
+		    for (int k = 0; k < LARGE_DIRECT; k++)
+		    {
+			list_add(&victims, inode->blocks[k], nblocks);
+		    }
+		    for (int t = 0; t < LARGE_TREES; t++)
+		    {
+			list_add(t ? &upper[t - 1] : &indirects, inode->tree[t], nblocks);
+		    }
+		    continue;
+		}
+		for (int k = 0; k < POINTERS_PER_INODE; k++)
+		{
+		    list_add(&victims, inode->direct[k], nblocks);
+		}
+		list_add(&indirects, inode->indirect, nblocks);
+	    }
+	}
+    }
+
+    // v3 trees from the top down, until only height 1 blocks are left
+    for (int h = LARGE_TREES; h > 1; h--)
+    {
+	struct block_list *list = &upper[h - 2];
+	struct block_list *below = h == 2 ? &indirects : &upper[h - 3];
+	for (int i = 0; i < list->count; i += AIO_BATCH)
+	{
+	    int n = list->count - i < AIO_BATCH ? list->count - i : AIO_BATCH;
+	    read_blocks_async(list->blocks + i, n, batch);
+	    for (int b = 0; b < n; b++)
+	    {
+		union fs_block *pointers = (union fs_block *)(batch + b * DISK_BLOCK_SIZE);
+		for (int m = 0; m < POINTERS_PER_BLOCK; m++)
+		{
+		    list_add(below, pointers->pointers[m], nblocks);
+		}
+		list_add(&victims, list->blocks[i + b], nblocks);
+	    }
+	}
+	free(list->blocks);
+    }
+
+    // indirect pointers, or overflow extents
+    for (int i = 0; i < indirects.count; i += AIO_BATCH)
+    {
+	int n = indirects.count - i < AIO_BATCH ? indirects.count - i : AIO_BATCH;
+	read_blocks_async(indirects.blocks + i, n, batch);
+	for (int b = 0; b < n; b++)
+	{
+	    union fs_block *indirect = (union fs_block *)(batch + b * DISK_BLOCK_SIZE);
+	    for (int m = 0; old_extents && m < EXTENTS_PER_BLOCK; m++)
+	    {
+		list_add_extent(&victims, &indirect->extents[m], nblocks);
+	    }
+	    for (int m = 0; !old_extents && m < POINTERS_PER_BLOCK; m++)
+	    {
+		list_add(&victims, indirect->pointers[m], nblocks);
+	    }
+	    list_add(&victims, indirects.blocks[i + b], nblocks);
+	}
+    }
+
+    // zero the old blocks with many writes in flight
+    zero_blocks_async(victims.blocks, victims.count, zeros);
+
+    free(victims.blocks);
+    free(indirects.blocks);
+    free(batch);
+    free(zeros);
+    return 1;
+}
+
+/* overwrite count consecutive blocks with zeros, ZERO_RUN blocks per write */
+static int zero_range( int blocknum, int count )
+{
+    char *zeros = block_alloc(ZERO_RUN);
+    if (!zeros)
+    {
+	return 0;
+    }
+    memset(zeros, 0, ZERO_RUN * DISK_BLOCK_SIZE);
+
+    for (int i = 0; i < count; i += ZERO_RUN)
+    {
+	disk_write_range(blocknum + i, count - i < ZERO_RUN ? count - i : ZERO_RUN, zeros);
+    }
+    free(zeros);
+    return 1;
+}
+
+/* tell the I/O statistics where the superblock, inode table and bitmap are; pointer blocks are marked as they turn up */
+static void stats_layout( int nblocks, int inodes, int nbitmapblocks )
+{
+    stats_set_class(0, 1, STATS_SUPER);
+    stats_set_class(1, inodes - 1, STATS_INODE);
+    stats_set_class(inodes, nbitmapblocks, STATS_BITMAP);
+    stats_set_class(inodes + nbitmapblocks, nblocks - inodes - nbitmapblocks, STATS_DATA);
+}
+
+/* creates a new filesystem on the disk, destroys data already present */
+int fs_format()
+{
+    return fs_format_flags(0);
+}
+
+/*
+fs_format with options: FS_FORMAT_EXTENTS selects extent based inodes,
+FS_FORMAT_QUICK skips zeroing the old data blocks and FS_FORMAT_DISCARD
+also punches them out of the image so the host gets the space back.
+*/
+static int format_disk( int flags );
+
+int fs_format_flags( int flags )
+{
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_FORMAT);
+    int result = format_disk(flags);
+    stats_end(&span);
+    return result;
+}
+
+static int format_disk( int flags )
+{
+    if (disk.mounted) 
+    { // return failure if disk is mounted
+	return 0; 
+    }
+
+    // an inode holds either extents or an indirect tree, not both
+    if ((flags & FS_FORMAT_EXTENTS) && (flags & FS_FORMAT_LARGE))
+    {
+	return 0;
+    }
+
+    // the old inode table is scanned straight from disk below, in its own format
+    union fs_block block;
+    cache_flush();
+    cache_read(0, block.data);
+    int old_extents = block.super.magic == FS_MAGIC_V2;
+    int old_large = block.super.magic == FS_MAGIC_V3;
+    cache_invalidate();
+
+    // the old superblock goes first, so a format cut short leaves nothing mountable
+    union fs_block empty;
+    memset(empty.data, 0, DISK_BLOCK_SIZE);
+    cache_write(0, empty.data);
+    cache_flush();
+
+    // set up super block
+    block.super.magic = flags & FS_FORMAT_EXTENTS ? FS_MAGIC_V2 : flags & FS_FORMAT_LARGE ? FS_MAGIC_V3 : FS_MAGIC;
+    block.super.nblocks = disk_size();
+	
+    // 10% of these to inodes
+    int nblocks = block.super.nblocks;
+    double ninodes = (double)nblocks * 0.1;
+    
+    // round up ninodes (from exactly 10%)
+    if ((int) ninodes < ninodes)
+    {
+	block.super.ninodeblocks = (int)ninodes + 1;
+    }
+    else
+    {
+	block.super.ninodeblocks = (int)ninodes;
+    }
+
+    block.super.ninodes = block.super.ninodeblocks * INODES_PER_BLOCK;
+    int inodes = block.super.ninodeblocks+1;
+    stats_layout(nblocks, inodes, (nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK);
+
+    // a quick format leaves old data where it is and only resets the metadata
+    int quick = flags & (FS_FORMAT_QUICK | FS_FORMAT_DISCARD);
+    if (!quick && !zero_old_blocks(nblocks, inodes, old_extents, old_large))
+    {
+	return 0;
+    }
+
+    // punch out everything past the superblock, or write the empty inode table in large runs
+    if (!(flags & FS_FORMAT_DISCARD) || nblocks < 2 || !disk_discard(1, nblocks - 1))
+    {
+	if (!zero_range(1, inodes - 1))
+	{
+	    return 0;
+	}
+    }
+
+    // free bitmap with only the superblock, inode table and bitmap in use
+    block.super.nbitmapblocks = (nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    block.super.clean = 1;
+    disk.nblocks = nblocks;
+    disk.bitmap_start = inodes;
+    disk.nbitmapblocks = block.super.nbitmapblocks;
+    if (!bitmap_init(nblocks, disk.nbitmapblocks))
+    {
+	return 0;
+    }
+    for (int i = 0; i < inodes + disk.nbitmapblocks; i++)
+    {
+	bitmap_set(i);
+    }
+    // every bitmap block is written, the old ones may hold stale bits
+    memset(bitmap_dirty, 1, disk.nbitmapblocks);
+    bitmap_sync();
+    bitmap_free();
+
+    // the root directory starts out empty, which takes nothing but its inode
+    union fs_block iblock;
+    memset(iblock.data, 0, DISK_BLOCK_SIZE);
+    iblock.inodes[FS_ROOT_INODE % INODES_PER_BLOCK].isvalid = INODE_DIR;
+    cache_write(1 + FS_ROOT_INODE / INODES_PER_BLOCK, iblock.data);
+    cache_commit();
+
+    // only once the bitmap and root inode are on disk does the superblock make them mountable
+    cache_write(0, block.data);
+    cache_flush();
+    return 1;
+}
+
+/* print the extents of a v2 inode, reading its overflow block if it has one */
+static void debug_extents( struct fs_inode *inode )
+{
+    union fs_block overflow;
+
+    printf("    extents:");
+    for (int k = 0; k < EXTENTS_PER_INODE && k < inode->nextents; k++)
+    {
+	printf(" %d-%d", inode->extents[k].start, inode->extents[k].start + inode->extents[k].length - 1);
+    }
+    printf("\n");
+
+    if (inode->overflow > 0)
+    {
+	printf("	overflow block: %d\n", inode->overflow);
+	printf("	overflow extents:");
+	cache_read(inode->overflow, overflow.data);
+	for (int k = 0; k < inode->nextents - EXTENTS_PER_INODE && k < EXTENTS_PER_BLOCK; k++)
+	{
+	    printf(" %d-%d", overflow.extents[k].start, overflow.extents[k].start + overflow.extents[k].length - 1);
+	}
+	printf("\n");
+    }
+}
+
+/* print the direct blocks and tree roots of a v3 inode */
+static void debug_tree( struct fs_inode *inode )
+{
+    static const char *names[LARGE_TREES] = { "indirect", "double indirect", "triple indirect" };
+
+    printf("    direct blocks:");
+    for (int k = 0; k < LARGE_DIRECT; k++)
+    {
+	if (inode->blocks[k] != 0)
+	{
+	    printf(" %d", inode->blocks[k]);
+	}
+    }
+    printf("\n");
+
+    for (int t = 0; t < LARGE_TREES; t++)
+    {
+	if (inode->tree[t] > 0)
+	{
+	    printf("\t%s block: %d\n", names[t], inode->tree[t]);
+	}
+    }
+}
+
+/* scans a mounted filesystem and repot on how the inodes and blocks are organized */
+void fs_debug()
+{
+    union fs_block block;
+    int mounted = disk.mounted;
+    struct stats_span span;
+
+    stats_begin(&span, STATS_OP_DEBUG);
+
+    // the scan below reads inode blocks through the block cache, with every other call held off
+    if (mounted)
+    {
+	pthread_rwlock_wrlock(&commit_lock);
+    }
+    inode_sync();
+
+    cache_read(0,block.data);
+
+    printf("superblock:\n");
+	
+    // check if magic number valid
+    int extents = block.super.magic == FS_MAGIC_V2;
+    int large = block.super.magic == FS_MAGIC_V3;
+    if (block.super.magic == FS_MAGIC || extents || large) 
+    {
+	printf("    magic number is valid\n");
+    } 
+    else 
+    {
+	printf("    magic number is not valid\n");
+    }
+
+    printf("    %d blocks on disk\n",block.super.nblocks);
+    printf("    %d blocks for inodes\n",block.super.ninodeblocks);
+    printf("    %d inodes total\n",block.super.ninodes);
+    if (extents)
+    {
+	printf("    inodes hold extents\n");
+    }
+    if (large)
+    {
+	printf("    inodes hold double and triple indirect blocks\n");
+    }
+    if (bitmap_region(&block.super))
+    {
+	printf("    %d blocks for the free bitmap\n",block.super.nbitmapblocks);
+	printf("    filesystem is %s\n",block.super.clean ? "clean" : "in use or not cleanly unmounted");
+    }
+    if (disk.mounted)
+    {
+	printf("    %d blocks free\n",nfree);
+    }
+
+    int i; // increments through all blocks
+    int inodes = block.super.ninodeblocks+1;
+
+    // look through inode blocks
+    for (i=1; i < inodes; i++)
+    {
+	cache_read(i, block.data);
+	for (int j = 0; j < INODES_PER_BLOCK; j++)
+	{
+	    
+	    if(block.inodes[j].isvalid & INODE_TYPE)
+	    {
+		printf("inode %d:\n", j+(INODES_PER_BLOCK)*(i-1));
+		if ((block.inodes[j].isvalid & INODE_TYPE) == INODE_DIR)
+		{
+		    printf("    directory\n");
+		}
+		if (large)
+		{
+		    printf("    size: %ld\n", (long)block.inodes[j].size_hi << 32 | (unsigned)block.inodes[j].size);
+		    debug_tree(&block.inodes[j]);
+		    continue;
+		}
+		printf("    size: %d\n", block.inodes[j].size);
+		if (extents)
+		{
+		    debug_extents(&block.inodes[j]);
+		    continue;
+		}
+		printf("    direct blocks:");
+		
+		for (int k=0; k < POINTERS_PER_INODE; k++)
+		{
+		    if (block.inodes[j].direct[k] != 0)
+		    {
+			printf(" %d", block.inodes[j].direct[k]);
+		    }
+		}
+		printf("\n");
+
+		union fs_block indirect;
+		if (block.inodes[j].indirect > 0)
+		{
+		    printf("	indirect block: %d\n", block.inodes[j].indirect);
+
+		    // read indirect block data
+		    printf("	indirect data blocks:");
+		    cache_read(block.inodes[j].indirect, indirect.data);
+		    for (int m=0; m < POINTERS_PER_BLOCK; m++)
+		    {
+			if (indirect.pointers[m] > 0)
+			{
+			    printf(" %d", indirect.pointers[m]);
+			}
+		    }
+		    printf("\n");
+		}
+	    }
+	}
+    }
+
+    if (mounted)
+    {
+	pthread_rwlock_unlock(&commit_lock);
+    }
+    stats_end(&span);
+}
+
+static void scan_mark( uint64_t *used, int blocknum )
+{
+    used[blocknum / 64] |= 1ULL << (blocknum % 64);
+}
+
+static void scan_mark_extent( uint64_t *used, const struct fs_extent *ext, int nblocks )
+{
+    for (int b = 0; ext->start > 0 && b < ext->length && ext->start + b < nblocks; b++)
+    {
+	scan_mark(used, ext->start + b);
+    }
+}
+
+/* scan one range of inode blocks and their indirect, overflow or pointer blocks into the job's own bitmap */
+static void *scan_inode_blocks( void *arg )
+{
+    struct scan_job *job = arg;
+    int nblocks = job->nblocks;
+    struct block_list indirects = { 0, 0, 0 };
+    struct block_list upper[LARGE_TREES - 1] = { { 0, 0, 0 } }; // v3 pointer blocks of height 2 and up
+    char *batch = block_alloc(AIO_BATCH);
+    if (!batch)
+    {
+	return 0;
+    }
+
+    for(int i=job->first; i < job->last; i += AIO_BATCH)
+    {
+	int n = job->last - i < AIO_BATCH ? job->last - i : AIO_BATCH;
+	read_range_async(i, n, batch);
+	for (int b = 0; b < n; b++)
+	{
+	    union fs_block *iblock = (union fs_block *)(batch + b * DISK_BLOCK_SIZE);
+	    ifree_scan_block(i + b - 1, iblock);
+	    for (int j=0; j < INODES_PER_BLOCK; j++)
+	    {
+		if ((iblock->inodes[j].isvalid & INODE_TYPE) && disk.extents)
+		{
+		    struct fs_inode *inode = &iblock->inodes[j];
+		    for (int k = 0; k < EXTENTS_PER_INODE && k < inode->nextents; k++)
+		    {
+			scan_mark_extent(job->used, &inode->extents[k], nblocks);
+		    }
+		    if (inode->overflow > 0 && inode->overflow < nblocks)
+		    {
+			scan_mark(job->used, inode->overflow);
+			list_add(&indirects, inode->overflow, nblocks);
+		    }
+		}
+		else if ((iblock->inodes[j].isvalid & INODE_TYPE) && disk.large)
+		{
+		    struct fs_inode *inode = &iblock->inodes[j];
+		    for (int k = 0; k < LARGE_DIRECT; k++)
+		    {
+			if (inode->blocks[k] > 0 && inode->blocks[k] < nblocks)
+			{
+			    scan_mark(job->used, inode->blocks[k]);
+			}
+		    }
+		    for (int t = 0; t < LARGE_TREES; t++)
+		    {
+			if (inode->tree[t] > 0 && inode->tree[t] < nblocks)
+			{
+			    scan_mark(job->used, inode->tree[t]);
+			    list_add(t ? &upper[t - 1] : &indirects, inode->tree[t], nblocks);
+			}
+		    }
+		}
+		else if (iblock->inodes[j].isvalid & INODE_TYPE)
+		{
+		    for (int k=0; k < POINTERS_PER_INODE; k++)
+		    {
+			if (iblock->inodes[j].direct[k] > 0 && iblock->inodes[j].direct[k] < nblocks)
+			{
+			    scan_mark(job->used, iblock->inodes[j].direct[k]);
+			}
+		    }
+
+		    // indirection, read in batches below
+		    if (iblock->inodes[j].indirect > 0 && iblock->inodes[j].indirect < nblocks)
+		    {
+			scan_mark(job->used, iblock->inodes[j].indirect);
+			list_add(&indirects, iblock->inodes[j].indirect, nblocks);
+		    }
+		}
+	    }
+	}
+    }
+
+    // v3 trees from the top down, until only height 1 blocks are left
+    for (int h = LARGE_TREES; h > 1; h--)
+    {
+	struct block_list *list = &upper[h - 2];
+	struct block_list *below = h == 2 ? &indirects : &upper[h - 3];
+	for (int i = 0; i < list->count; i += AIO_BATCH)
+	{
+	    int n = list->count - i < AIO_BATCH ? list->count - i : AIO_BATCH;
+	    read_blocks_async(list->blocks + i, n, batch);
+	    for (int b = 0; b < n; b++)
+	    {
+		union fs_block *pointers = (union fs_block *)(batch + b * DISK_BLOCK_SIZE);
+		for (int m = 0; m < POINTERS_PER_BLOCK; m++)
+		{
+		    if (pointers->pointers[m] > 0 && pointers->pointers[m] < nblocks)
+		    {
+			scan_mark(job->used, pointers->pointers[m]);
+			list_add(below, pointers->pointers[m], nblocks);
+		    }
+		}
+	    }
+	}
+	free(list->blocks);
+    }
+
+    for (int i = 0; i < indirects.count; i += AIO_BATCH)
+    {
+	int n = indirects.count - i < AIO_BATCH ? indirects.count - i : AIO_BATCH;
+	read_blocks_async(indirects.blocks + i, n, batch);
+	for (int b = 0; b < n; b++)
+	{
+	    union fs_block *indirect = (union fs_block *)(batch + b * DISK_BLOCK_SIZE);
+	    for (int m = 0; disk.extents && m < EXTENTS_PER_BLOCK; m++)
+	    {
+		scan_mark_extent(job->used, &indirect->extents[m], nblocks);
+	    }
+	    for (int m=0; !disk.extents && m < POINTERS_PER_BLOCK; m++)
+	    {
+		if (indirect->pointers[m] > 0 && indirect->pointers[m] < nblocks)
+		{
+		    scan_mark(job->used, indirect->pointers[m]);
+		}
+	    }
+	}
+    }
+
+    free(indirects.blocks);
+    free(batch);
+    job->ok = 1;
+    return 0;
+}
+
+/*
+mark every block referenced from the inode table as in use (full scan).
+The inode table is split into one contiguous range per thread; each
+thread fills a private bitmap and the results are ORed together.
+*/
+static int rebuild_bitmap( int nblocks, int inodes )
+{
+    int ninodeblocks = inodes - 1;
+    int nthreads = mount_threads > 0 ? mount_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > ninodeblocks)
+    {
+	nthreads = ninodeblocks;
+    }
+    if (nthreads < 1)
+    {
+	nthreads = 1;
+    }
+
+    struct scan_job *jobs = calloc(nthreads, sizeof(struct scan_job));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    int ok = jobs && threads;
+
+    for (int t = 0; ok && t < nthreads; t++)
+    {
+	jobs[t].first = 1 + (long)ninodeblocks * t / nthreads;
+	jobs[t].last = 1 + (long)ninodeblocks * (t + 1) / nthreads;
+	jobs[t].nblocks = nblocks;
+	jobs[t].used = calloc(bitmap_words, sizeof(uint64_t));
+	ok = jobs[t].used != 0;
+    }
+
+    // the calling thread takes the first range itself
+    for (int t = 1; ok && t < nthreads; t++)
+    {
+	if (pthread_create(&threads[t], 0, scan_inode_blocks, &jobs[t]))
+	{
+	    scan_inode_blocks(&jobs[t]);
+	    threads[t] = 0;
+	}
+    }
+    if (ok)
+    {
+	scan_inode_blocks(&jobs[0]);
+    }
+    for (int t = 1; ok && t < nthreads; t++)
+    {
+	if (threads[t])
+	{
+	    pthread_join(threads[t], 0);
+	}
+    }
+
+    for (int t = 0; jobs && t < nthreads; t++)
+    {
+	ok = ok && jobs[t].ok;
+	for (int w = 0; ok && w < bitmap_words; w++)
+	{
+	    bitmap[w] |= jobs[t].used[w];
+	}
+	free(jobs[t].used);
+    }
+    free(jobs);
+    free(threads);
+
+    // the per-block free inode counts are complete now
+    for (int i = 0; i < ninodeblocks; i++)
+    {
+	ifree_summarize(i);
+    }
+    bitmap_count();
+    return ok;
+}
+
+/* load the on-disk bitmap saved by the last clean unmount */
+static void load_bitmap()
+{
+    for (int i = 0; i < disk.nbitmapblocks; i += AIO_BATCH)
+    {
+	int n = disk.nbitmapblocks - i < AIO_BATCH ? disk.nbitmapblocks - i : AIO_BATCH;
+	read_range_async(disk.bitmap_start + i, n, (char *)bitmap + (size_t)i * DISK_BLOCK_SIZE);
+    }
+
+    // padding bits past the last block always read as in use
+    if (disk.nblocks % 64)
+    {
+	bitmap[bitmap_words - 1] |= ~0ULL << (disk.nblocks % 64);
+    }
+    bitmap_count();
+}
+
+static void txn_start();
+static int mount_disk();
+
+/* examine the disk for a filesystem, build a free block bitmap, prepare the filesystem for use */
+int fs_mount()
+{
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_MOUNT);
+    int result = mount_disk();
+    stats_end(&span);
+    return result;
+}
+
+static int mount_disk()
+{
+    union fs_block block;
+    
+    // check if already mounted
+    if (disk.mounted) 
+    {
+	printf("File system already mounted\n");
+	return 0;
+    }
+
+    // the scans below read the disk directly, so nothing may be pending
+    cache_flush();
+    cache_read(0, block.data); // read superblock
+
+    // check for correct magic number
+    if (block.super.magic != FS_MAGIC && block.super.magic != FS_MAGIC_V2 && block.super.magic != FS_MAGIC_V3)
+    {
+	printf("Invalid Magic Number\n");
+	return 0;
+    }
+
+    int nblocks = block.super.nblocks;
+    int inodes = block.super.ninodeblocks+1;
+    super = block.super;
+    if (!itable_init(super.ninodeblocks))
+    {
+	return 0;
+    }
+    if (!ifree_init(super.ninodeblocks))
+    {
+	itable_free();
+	return 0;
+    }
+    disk.nblocks = nblocks;
+    disk.bitmap_start = inodes;
+    disk.nbitmapblocks = bitmap_region(&block.super);
+    disk.extents = block.super.magic == FS_MAGIC_V2;
+    disk.large = block.super.magic == FS_MAGIC_V3;
+    stats_layout(nblocks, inodes, disk.nbitmapblocks);
+
+    // create free block bitmap
+    if (!bitmap_init(nblocks, disk.nbitmapblocks))
+    {
+	itable_free();
+	ifree_free();
+	return 0;
+    }
+
+    if (disk.nbitmapblocks && block.super.clean)
+    {
+	load_bitmap();
+    }
+    else
+    {
+	for(int i=0; i < inodes + disk.nbitmapblocks; i++)
+	{
+	    bitmap_set(i); // superblock, inode and bitmap blocks filled
+	}
+	if (!rebuild_bitmap(nblocks, inodes))
+	{
+	    bitmap_free();
+	    itable_free();
+	    ifree_free();
+	    return 0;
+	}
+	memset(bitmap_dirty, 1, disk.nbitmapblocks);
+    }
+
+    // stay marked unclean on disk until fs_unmount
+    if (disk.nbitmapblocks)
+    {
+	block.super.clean = 0;
+	super.clean = 0;
+	cache_write(0, block.data);
+	bitmap_sync();
+	cache_flush();
+    }
+
+    memset(dcache, 0, sizeof(dcache));
+    txn_start();
+    disk.mounted = 1; 
+    return 1;
+}
+
+/* set how many threads a full fs_mount scan uses, 0 for one per CPU */
+void fs_set_mount_threads( int nthreads )
+{
+    mount_threads = nthreads > 0 ? nthreads : 0;
+}
+
+/* wait for a readahead window's requests so its buffer can be used */
+static void window_wait( struct ra_window *win )
+{
+    if (win->pending)
+    {
+	cache_finish_extents(win->reqs, win->nreqs);
+	win->pending = 0;
+    }
+}
+
+/* forget the readahead of a stream, waiting for anything still in flight */
+static void stream_reset( struct fs_stream *s, int inumber )
+{
+    for (int w = 0; w < 2; w++)
+    {
+	window_wait(&s->win[w]);
+	s->win[w].count = 0;
+    }
+    s->inumber = inumber;
+    s->next_offset = -1;
+    s->window = 0;
+}
+
+/* drop the readahead of inumber once its blocks may have changed */
+static void stream_drop( int inumber )
+{
+    struct fs_stream *s = &streams[inumber % RA_STREAMS];
+    pthread_mutex_lock(&s->lock);
+    if (s->inumber == inumber)
+    {
+	stream_reset(s, 0);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* drop every stream and release the buffers */
+static void stream_drop_all()
+{
+    for (int i = 0; i < RA_STREAMS; i++)
+    {
+	stream_reset(&streams[i], 0);
+	for (int w = 0; w < 2; w++)
+	{
+	    free(streams[i].win[w].buf);
+	    streams[i].win[w].buf = 0;
+	}
+    }
+}
+
+/* how many of run blocks from fblock on come before the next readahead window */
+static int stream_gap( struct fs_stream *s, int fblock, int run )
+{
+    for (int w = 0; w < 2; w++)
+    {
+	struct ra_window *win = &s->win[w];
+	if (win->count && win->first > fblock && win->first - fblock < run)
+	{
+	    run = win->first - fblock;
+	}
+    }
+    return run;
+}
+
+/* the prefetched copy of file block fblock, or null if no window holds it */
+static char *stream_block( struct fs_stream *s, int fblock )
+{
+    for (int w = 0; w < 2; w++)
+    {
+	struct ra_window *win = &s->win[w];
+	if (fblock >= win->first && fblock < win->first + win->count)
+	{
+	    window_wait(win);
+	    return win->buf + (size_t)(fblock - win->first) * DISK_BLOCK_SIZE;
+	}
+    }
+    return 0;
+}
+
+/*
+Called after a read that ended at file block last. Once a sequential
+reader has moved into the newest window, the window after it is started
+in the other slot (which the reader is done with) and left in flight,
+so the disk works while the caller deals with the data. The window
+doubles each time, from RA_MIN up to RA_MAX blocks.
+*/
+static void stream_advance( struct fs_stream *s, struct fs_map *map, int last )
+{
+    struct ra_window *newest = &s->win[s->newest];
+    if (newest->count && last < newest->first)
+    {
+	return;
+    }
+
+    int start = newest->count ? newest->first + newest->count : last + 1;
+    if (start <= last)
+    {
+	start = last + 1;
+    }
+    int eof = (inode_size(&map->inode) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    s->window = s->window ? s->window * 2 : RA_MIN;
+    if (s->window > RA_MAX)
+    {
+	s->window = RA_MAX;
+    }
+    int count = eof - start < s->window ? eof - start : s->window;
+    if (count <= 0)
+    {
+	return;
+    }
+
+    struct ra_window *win = &s->win[!s->newest];
+    window_wait(win);
+    win->count = 0;
+    if (!win->buf && !(win->buf = block_alloc(RA_MAX)))
+    {
+	return;
+    }
+
+    // mapping the window here also pulls in the indirect or overflow block early
+    struct cache_extent runs[RA_MAX];
+    int nruns = 0;
+    int run;
+    for (int i = 0; i < count; i += run)
+    {
+	char *dest = win->buf + (size_t)i * DISK_BLOCK_SIZE;
+	int b = map_run(map, start + i, count - i, &run);
+	if (!b)
+	{
+	    memset(dest, 0, DISK_BLOCK_SIZE);
+	    continue;
+	}
+	runs[nruns].blocknum = b;
+	runs[nruns].count = run;
+	runs[nruns].data = dest;
+	nruns++;
+    }
+
+    win->reqs = cache_start_extents(runs, nruns, &win->nreqs);
+    win->pending = 1;
+    win->first = start;
+    win->count = count;
+    s->newest = !s->newest;
+}
+
+static int write_through( int inumber, const char *data, int length, long offset );
+
+/*
+Write-behind: each slot buffers the dirty blocks [first, first + count)
+of one inode, with writes up to byte end applied. Blocks are only
+allocated when the slot is flushed, so the allocator sees the whole run
+at once and the inode is saved once per flush. Everything the flush will
+allocate is counted in reserved up front: the data blocks, the zeroed
+gap in front of the run on an extent inode, and DIRTY_SLACK pointer
+blocks. Other allocations leave reserved blocks alone, and only the
+flush they were promised to spends them, so a flush does not run out of
+space.
+A slot is only touched under its lock, and only flushed by a thread that
+holds the owning inode exclusively.
+*/
+
+/* promise count free blocks to a buffered write, 0 if they are not there */
+static int reserve_blocks( int count )
+{
+    pthread_mutex_lock(&alloc_lock);
+    int ok = reserved + count <= nfree;
+    if (ok)
+    {
+	reserved += count;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return ok;
+}
+
+static void unreserve( int count )
+{
+    pthread_mutex_lock(&alloc_lock);
+    reserved -= count;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+static int dirty_flush( struct fs_dirty *d )
+{
+    int ok = 1;
+    if (d->count)
+    {
+	long start = (long)d->first * DISK_BLOCK_SIZE;
+	// the allocations write_through makes come out of this slot's reservation
+	spend_reserved = d->reserved;
+	ok = write_through(d->inumber, d->buf, d->end - start, start) == d->end - start;
+	unreserve(spend_reserved);
+	spend_reserved = 0;
+    }
+    d->inumber = 0;
+    d->count = 0;
+    d->end = 0;
+    d->reserved = 0;
+    return ok;
+}
+
+/* flush the buffered writes of inumber, if there are any; the caller holds inumber exclusively */
+static int dirty_flush_inode( int inumber )
+{
+    struct fs_dirty *d = &dirty[inumber % DIRTY_SLOTS];
+    pthread_mutex_lock(&d->lock);
+    int ok = d->inumber != inumber || dirty_flush(d);
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+/* whether inumber has buffered writes */
+static int dirty_holds( int inumber )
+{
+    struct fs_dirty *d = &dirty[inumber % DIRTY_SLOTS];
+    pthread_mutex_lock(&d->lock);
+    int held = d->inumber == inumber && d->count;
+    pthread_mutex_unlock(&d->lock);
+    return held;
+}
+
+/*
+empty the locked slot d so inumber can use it. The writes of another
+inode are flushed only if that inode can be had exclusively right away;
+otherwise 0 is returned and the slot is left alone, as waiting here
+could deadlock against the owner.
+*/
+static int dirty_claim( struct fs_dirty *d, int inumber )
+{
+    pthread_rwlock_t *owner = inode_lock(d->inumber);
+    if (!d->count || d->inumber == inumber || owner == inode_lock(inumber))
+    {
+	dirty_flush(d);
+	return 1;
+    }
+    if (pthread_rwlock_trywrlock(owner))
+    {
+	return 0;
+    }
+    dirty_flush(d);
+    pthread_rwlock_unlock(owner);
+    return 1;
+}
+
+/* forget the buffered writes of inumber without writing them */
+static void dirty_discard( int inumber )
+{
+    struct fs_dirty *d = &dirty[inumber % DIRTY_SLOTS];
+    pthread_mutex_lock(&d->lock);
+    if (d->inumber == inumber)
+    {
+	unreserve(d->reserved);
+	d->inumber = 0;
+	d->count = 0;
+	d->end = 0;
+	d->reserved = 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* flush every slot and release the buffers */
+static int dirty_flush_all()
+{
+    int ok = 1;
+    for (int i = 0; i < DIRTY_SLOTS; i++)
+    {
+	ok &= dirty_flush(&dirty[i]);
+	free(dirty[i].buf);
+	dirty[i].buf = 0;
+    }
+    return ok;
+}
+
+/*
+Group commit. Every call runs with commit_lock shared and a commit takes
+it exclusively, so it never sees a call half done. Metadata changes
+collect in memory (the inode table, the bitmap and the pointer blocks
+held in the cache) and a commit writes them out together: after
+COMMIT_OPS changes, when held blocks fill half the cache, on the timer
+every COMMIT_MS, or when fs_commit closes the outermost batch. Buffered
+writes have no blocks yet, so nothing on disk refers to them; only
+fs_commit and fs_fsync flush them first, the automatic commits leave
+them to grow. Blocks a delete releases only become free once a commit
+has written the inode that let go of them, and a call that leaves more
+of those than free blocks commits straight away.
+*/
+static void commit_lock_init()
+{
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    // a steady stream of callers must not keep a commit waiting
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&commit_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+/* write the metadata changed since the last commit to disk, and the buffered writes before it if asked to */
+static int txn_commit( int flush )
+{
+    int ok = 1;
+    struct stats_span span;
+
+    stats_begin(&span, STATS_OP_COMMIT);
+    pthread_rwlock_wrlock(&commit_lock);
+    for (int i = 0; flush && i < DIRTY_SLOTS; i++)
+    {
+	ok &= dirty_flush(&dirty[i]);
+    }
+    inode_sync();
+    bitmap_sync();
+    cache_commit();
+    bitmap_settle();
+
+    pthread_mutex_lock(&txn_lock);
+    txn_ops = 0;
+    pthread_mutex_unlock(&txn_lock);
+    pthread_rwlock_unlock(&commit_lock);
+    stats_end(&span);
+    return ok;
+}
+
+static void txn_enter()
+{
+    pthread_rwlock_rdlock(&commit_lock);
+}
+
+/* leave a call, committing if it changed something and enough has collected */
+static void txn_leave( int changed )
+{
+    pthread_rwlock_unlock(&commit_lock);
+    if (!changed)
+    {
+	return;
+    }
+
+    // released blocks only come back at a commit, so commit early when they outnumber the free ones
+    pthread_mutex_lock(&alloc_lock);
+    int starved = npending > nfree;
+    pthread_mutex_unlock(&alloc_lock);
+
+    pthread_mutex_lock(&txn_lock);
+    txn_ops++;
+    int due = !txn_depth && (txn_ops >= COMMIT_OPS || starved || cache_held() > cache_capacity() / 2);
+    pthread_mutex_unlock(&txn_lock);
+    if (due)
+    {
+	txn_commit(0);
+    }
+}
+
+/* commit what has collected every COMMIT_MS while mounted */
+static void *txn_timer( void *arg )
+{
+    pthread_mutex_lock(&txn_lock);
+    while (txn_running)
+    {
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	t.tv_nsec += COMMIT_MS % 1000 * 1000000L;
+	t.tv_sec += COMMIT_MS / 1000 + t.tv_nsec / 1000000000L;
+	t.tv_nsec %= 1000000000L;
+	pthread_cond_timedwait(&txn_wake, &txn_lock, &t);
+
+	if (txn_running && txn_ops && !txn_depth)
+	{
+	    pthread_mutex_unlock(&txn_lock);
+	    txn_commit(0);
+	    pthread_mutex_lock(&txn_lock);
+	}
+    }
+    pthread_mutex_unlock(&txn_lock);
+    return 0;
+}
+
+static void txn_start()
+{
+    pthread_once(&commit_once, commit_lock_init);
+
+    pthread_mutex_lock(&txn_lock);
+    txn_depth = 0;
+    txn_ops = 0;
+    txn_running = 1;
+    if (pthread_create(&txn_thread, 0, txn_timer, 0))
+    {
+	// no timer, the other triggers still commit
+	txn_running = 0;
+    }
+    pthread_mutex_unlock(&txn_lock);
+}
+
+static void txn_stop()
+{
+    pthread_mutex_lock(&txn_lock);
+    int running = txn_running;
+    txn_running = 0;
+    pthread_cond_signal(&txn_wake);
+    pthread_mutex_unlock(&txn_lock);
+
+    if (running)
+    {
+	pthread_join(txn_thread, 0);
+    }
+}
+
+/* write back everything the filesystem holds in memory and mark it clean */
+int fs_unmount()
+{
+    union fs_block block;
+
+    if (!disk.mounted)
+    {
+	return 0;
+    }
+
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_UNMOUNT);
+    txn_stop();
+    dirty_flush_all();
+    stream_drop_all();
+    inode_sync();
+    bitmap_sync();
+    cache_commit();
+    if (bitmap_settle())
+    {
+	bitmap_sync();
+	cache_commit();
+    }
+
+    // only once the bitmap and inodes are on disk may the superblock say so
+    if (disk.nbitmapblocks)
+    {
+	super.clean = 1;
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	block.super = super;
+	cache_write(0, block.data);
+	cache_flush();
+    }
+
+    // maps kept by open files and cached names must not outlive the inode table
+    for (int i = 0; i < INODE_LOCKS; i++)
+    {
+	inode_gens[i]++;
+    }
+    memset(dcache, 0, sizeof(dcache));
+    itable_free();
+    ifree_free();
+    bitmap_free();
+    disk.mounted = 0;
+    stats_end(&span);
+    return 1;
+}
+
+/* take a free inode and make it an empty file or directory; the caller has done txn_enter */
+static int create_inode( int type )
+{
+    // inode 0 is never handed out, so 0 means all nodes occupied
+    pthread_mutex_lock(&ifree_lock);
+    int node = ifree_take();
+    pthread_mutex_unlock(&ifree_lock);
+    struct fs_inode *inode = inode_get(node);
+    if (!node || !inode)
+    {
+	return 0;
+    }
+
+    // initilize inode, one generation on from whatever it held before
+    pthread_rwlock_wrlock(inode_lock(node));
+    unsigned gen = ((unsigned)inode->isvalid >> INODE_GEN_SHIFT) + 1;
+    memset(inode, 0, sizeof(struct fs_inode));
+    inode->isvalid = type | gen << INODE_GEN_SHIFT;
+    inode_dirty(node);
+    inode_gens[(unsigned)node % INODE_LOCKS]++;
+    pthread_rwlock_unlock(inode_lock(node));
+    return node;
+}
+
+/* create a new inode of zero length, returns number of inode */
+int fs_create()
+{
+    if (!disk.mounted)
+    {
+	return 0;
+    }
+
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_CREATE);
+    txn_enter();
+    int node = create_inode(INODE_FILE);
+    txn_leave(node != 0);
+    stats_end(&span);
+    return node;
+}
+
+/* free an inode and its blocks, directories only if asked to, and only while it holds generation gen; the caller has done txn_enter */
+static int delete_inode( int inumber, int dirs, unsigned gen )
+{
+    pthread_rwlock_t *lock = inode_lock(inumber);
+    pthread_rwlock_wrlock(lock);
+
+    struct fs_map map;
+    int type = map_load(&map, inumber) ? map.inode.isvalid & INODE_TYPE : 0;
+    if (!type || (type == INODE_DIR && !dirs) || (gen != INODE_ANY_GEN && (unsigned)map.inode.isvalid >> INODE_GEN_SHIFT != gen))
+    {
+	pthread_rwlock_unlock(lock);
+	return 0;
+    }
+
+    dirty_discard(inumber);
+    stream_drop(inumber);
+    map_free(&map);
+    // the generation stays, so the next file made in this inode gets a new one
+    map.inode.isvalid &= ~INODE_TYPE;
+    map.inode.size = 0;
+    map_save(&map);
+    pthread_mutex_lock(&ifree_lock);
+    ifree_release(inumber);
+    pthread_mutex_unlock(&ifree_lock);
+
+    pthread_rwlock_unlock(lock);
+    return 1;
+}
+
+/* delete the inode indicated by the number; directories only go through fs_unlink */
+int fs_delete( int inumber )
+{
+    if (!disk.mounted)
+    {
+	return 0;
+    }
+
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_DELETE);
+    txn_enter();
+    int ok = delete_inode(inumber, 0, INODE_ANY_GEN);
+    txn_leave(ok);
+    stats_end(&span);
+    return ok;
+}
+
+/* return the logical size of of the given inode (bytes) */
+long fs_getsize( int inumber )
+{
+    if (!disk.mounted)
+    {
+	return -1;
+    }
+
+    pthread_rwlock_t *lock = inode_lock(inumber);
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_GETSIZE);
+    txn_enter();
+    pthread_rwlock_rdlock(lock);
+
+    long size = -1;
+    struct fs_inode *inode = inode_get(inumber);
+    if (inode && (inode->isvalid & INODE_TYPE))
+    {
+	// buffered writes may already have grown the file
+	struct fs_dirty *d = &dirty[inumber % DIRTY_SLOTS];
+	size = inode_size(inode);
+	pthread_mutex_lock(&d->lock);
+	if (d->inumber == inumber && d->end > size)
+	{
+	    size = d->end;
+	}
+	pthread_mutex_unlock(&d->lock);
+    }
+
+    pthread_rwlock_unlock(lock);
+    txn_leave(0);
+    stats_end(&span);
+    return size;
+}
+
+/* read through the map of an inode the caller holds at least shared */
+static int read_inode( struct fs_map *map, char *data, int length, long offset )
+{
+    int inumber = map->inumber;
+    if (!(map->inode.isvalid & INODE_TYPE))
+    {
+	return 0;
+    }
+
+    long size = inode_size(&map->inode);
+    if (offset < 0 || length <= 0 || offset >= size)
+    {
+	return 0;
+    }
+    if (length > size - offset)
+    {
+	length = size - offset;
+    }
+
+    int first = offset/DISK_BLOCK_SIZE;
+    int last = (offset + length - 1)/DISK_BLOCK_SIZE;
+    long end = offset + length;
+    int head_partial = offset % DISK_BLOCK_SIZE != 0 || end < (long)(first + 1) * DISK_BLOCK_SIZE;
+    int tail_partial = last != first && end % DISK_BLOCK_SIZE != 0;
+    union fs_block head, tail;
+    struct cache_extent *runs = malloc((last - first + 1) * sizeof(struct cache_extent));
+    int nruns = 0;
+    if (!runs)
+    {
+	return 0;
+    }
+
+    // one reader at a time drives the readahead of a slot, any others read without it
+    struct fs_stream *s = &streams[inumber % RA_STREAMS];
+    if (pthread_mutex_trylock(&s->lock))
+    {
+	s = 0;
+    }
+    else if (s->inumber != inumber)
+    {
+	stream_reset(s, inumber);
+    }
+    int sequential = s && (offset == 0 || offset == s->next_offset);
+
+    // whole blocks land straight in data, one extent per physical run; partial ones go through head and tail
+    int run;
+    for (int i = first; i <= last; i += run)
+    {
+	long pos = (long)i * DISK_BLOCK_SIZE;
+	char *dest = data + (pos - offset);
+	char *ahead = s ? stream_block(s, i) : 0;
+	int start = 0;
+
+	run = 1;
+	if (!ahead)
+	{
+	    start = map_run(map, i, last - i + 1, &run);
+	    run = s ? stream_gap(s, i, run) : run;
+	}
+
+	if (i == first && head_partial)
+	{
+	    dest = head.data;
+	    run = 1;
+	}
+	else if (i == last && tail_partial)
+	{
+	    dest = tail.data;
+	    run = 1;
+	}
+	else if (i + run - 1 == last && tail_partial)
+	{
+	    run--;
+	}
+
+	if (ahead)
+	{
+	    memcpy(dest, ahead, DISK_BLOCK_SIZE);
+	    continue;
+	}
+	if (!start)
+	{
+	    memset(dest, 0, DISK_BLOCK_SIZE);
+	    continue;
+	}
+	runs[nruns].blocknum = start;
+	runs[nruns].count = run;
+	runs[nruns].data = dest;
+	nruns++;
+    }
+    cache_read_extents(runs, nruns);
+    free(runs);
+
+    if (head_partial)
+    {
+	long hi = end < (long)(first + 1) * DISK_BLOCK_SIZE ? end : (long)(first + 1) * DISK_BLOCK_SIZE;
+	memcpy(data, head.data + offset % DISK_BLOCK_SIZE, hi - offset);
+    }
+    if (tail_partial)
+    {
+	long pos = (long)last * DISK_BLOCK_SIZE;
+	memcpy(data + (pos - offset), tail.data, end - pos);
+    }
+
+    if (s)
+    {
+	// keep a sequential reader's next blocks coming
+	if (sequential)
+	{
+	    stream_advance(s, map, last);
+	}
+	else
+	{
+	    s->window = 0;
+	}
+	s->next_offset = end;
+	pthread_mutex_unlock(&s->lock);
+    }
+    return length;
+}
+
+static int read_map( struct fs_map *map, int inumber, char *data, int length, long offset );
+static int write_map( struct fs_map *map, int inumber, const char *data, int length, long offset );
+
+/* read data from a valid inode; readers of the same inode run in parallel */
+int fs_read( int inumber, char *data, int length, long offset )
+{
+    struct fs_map map;
+    map.inumber = 0;
+    return read_map(&map, inumber, data, length, offset);
+}
+
+/* read through a map that is reloaded only if its inode changed */
+static int read_map( struct fs_map *map, int inumber, char *data, int length, long offset )
+{
+    if (!disk.mounted || !inode_get(inumber))
+    {
+	return 0;
+    }
+
+    // buffered writes reach the blocks first, which needs the inode exclusively
+    pthread_rwlock_t *lock = inode_lock(inumber);
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_READ);
+    txn_enter();
+    int flushed = dirty_holds(inumber);
+    if (flushed)
+    {
+	pthread_rwlock_wrlock(lock);
+	dirty_flush_inode(inumber);
+	pthread_rwlock_unlock(lock);
+    }
+
+    pthread_rwlock_rdlock(lock);
+    int result = map_refresh(map, inumber) ? read_inode(map, data, length, offset) : 0;
+    pthread_rwlock_unlock(lock);
+    txn_leave(flushed);
+    stats_end(&span);
+    return result;
+}
+
+/* write data to a valid inode right away, allocating its blocks */
+static int write_through( int inumber, const char *data, int length, long offset )
+{
+    struct fs_map map;
+    if (!map_load(&map, inumber) || !(map.inode.isvalid & INODE_TYPE))
+    {
+	return 0;
+    }
+
+    // prefetched blocks of this inode may be about to change
+    stream_drop(inumber);
+
+    long maxsize = (long)map_max_blocks() * DISK_BLOCK_SIZE;
+    if (offset < 0 || length <= 0 || offset >= maxsize)
+    {
+	return 0;
+    }
+    if (length > maxsize - offset)
+    {
+	length = maxsize - offset;
+    }
+
+    int first = offset/DISK_BLOCK_SIZE;
+    int last = (offset + length - 1)/DISK_BLOCK_SIZE;
+
+    // extents only grow at the end, so a write past it first fills the gap with zeroed blocks
+    if (disk.extents)
+    {
+	union fs_block zero;
+	memset(zero.data, 0, DISK_BLOCK_SIZE);
+	for (int i = map_extent_blocks(&map); i < first; i++)
+	{
+	    int b = map_alloc(&map, i, 0);
+	    if (!b)
+	    {
+		map_save(&map);
+		return 0;
+	    }
+	    cache_write(b, zero.data);
+	}
+    }
+
+    // allocate every missing block up front so the physical runs are known
+    int fresh_first = 0;
+    int fresh_last = 0;
+    int stretch = 0;
+    int run;
+    for (int i = first; i <= last; i += run)
+    {
+	if (map_run(&map, i, last - i + 1, &run))
+	{
+	    stretch = 0;
+	    continue;
+	}
+	run = 1;
+
+	// place each unmapped stretch as a whole, right after the previous block if it fits there
+	int goal = 0;
+	if (!stretch)
+	{
+	    while (i + stretch <= last && !map_block(&map, i + stretch))
+	    {
+		stretch++;
+	    }
+	    int prev = i > 0 ? map_block(&map, i - 1) : 0;
+	    goal = find_free_run(prev ? prev + 1 : 0, stretch);
+	}
+	stretch--;
+	if (!map_alloc(&map, i, goal))
+	{
+	    // disk full, write what fits
+	    last = i - 1;
+	    break;
+	}
+	fresh_first |= i == first;
+	fresh_last = i == last;
+    }
+
+    if (last < first)
+    {
+	map_save(&map);
+	return 0;
+    }
+
+    long end = offset + length;
+    if (end > (long)(last + 1) * DISK_BLOCK_SIZE)
+    {
+	end = (long)(last + 1) * DISK_BLOCK_SIZE;
+	fresh_last = 0;
+    }
+
+    for (int i = first; i <= last; i += run)
+    {
+	long pos = (long)i * DISK_BLOCK_SIZE;
+	int start = map_run(&map, i, last - i + 1, &run);
+
+	if (offset > pos || end < pos + DISK_BLOCK_SIZE)
+	{
+	    run = 1;
+	    // partial block: merge with what is already there
+	    union fs_block block;
+	    long lo = offset > pos ? offset : pos;
+	    long hi = end < pos + DISK_BLOCK_SIZE ? end : pos + DISK_BLOCK_SIZE;
+
+	    if ((i == first && fresh_first) || (i == last && fresh_last))
+	    {
+		memset(block.data, 0, DISK_BLOCK_SIZE);
+	    }
+	    else
+	    {
+		cache_read(start, block.data);
+	    }
+	    memcpy(block.data + lo - pos, data + lo - offset, hi - lo);
+	    cache_write(start, block.data);
+	    continue;
+	}
+
+	// only whole blocks go out as one range
+	while ((long)(i + run) * DISK_BLOCK_SIZE > end)
+	{
+	    run--;
+	}
+	cache_write_range(start, run, data + pos - offset);
+    }
+
+    if (end > inode_size(&map.inode))
+    {
+	inode_set_size(&map.inode, end);
+    }
+    map_save(&map);
+
+    return end - offset;
+}
+
+/* buffer a write to an inode the caller holds exclusively, looking up its blocks through map */
+static int write_buffered( struct fs_map *map, int inumber, const char *data, int length, long offset )
+{
+    struct fs_inode *inode = inode_get(inumber);
+    if (!inode || (inode->isvalid & INODE_TYPE) != INODE_FILE || offset < 0 || length <= 0 || offset / DISK_BLOCK_SIZE >= map_max_blocks())
+    {
+	return 0;
+    }
+
+    struct fs_dirty *d = &dirty[inumber % DIRTY_SLOTS];
+    int first = offset/DISK_BLOCK_SIZE;
+    int last = first + (offset % DISK_BLOCK_SIZE + length - 1)/DISK_BLOCK_SIZE;
+
+    // writes that cannot be buffered go straight to disk, after anything buffered before them
+    pthread_mutex_lock(&d->lock);
+    if (last >= map_max_blocks() || last - first >= DIRTY_MAX
+	    || (!d->buf && !(d->buf = block_alloc(DIRTY_MAX))))
+    {
+	if (d->inumber == inumber)
+	{
+	    dirty_flush(d);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return write_through(inumber, data, length, offset);
+    }
+
+    // a write that does not continue the buffered run flushes it and starts a new one
+    if (d->inumber != inumber || first < d->first || first > d->first + d->count || last >= d->first + DIRTY_MAX)
+    {
+	if (!dirty_claim(d, inumber))
+	{
+	    // another inode's writes are in the way and it is busy
+	    pthread_mutex_unlock(&d->lock);
+	    return write_through(inumber, data, length, offset);
+	}
+	d->inumber = inumber;
+	d->first = first;
+    }
+
+    // the flush above may have mapped more blocks, so only look now
+    map_refresh(map, inumber);
+
+    // bring in the blocks the buffer grows by, with their old contents if the write only covers part
+    for (int i = d->first + d->count; i <= last; i++)
+    {
+	char *dest = d->buf + (size_t)(i - d->first) * DISK_BLOCK_SIZE;
+	int run;
+	int b = map_run(map, i, 1, &run);
+	if (!b)
+	{
+	    // the first new block of a run also pays for its pointer blocks and any extent gap
+	    int need = 1;
+	    if (!d->reserved)
+	    {
+		need += DIRTY_SLACK;
+		if (disk.extents && d->first > map_extent_blocks(map))
+		{
+		    need += d->first - map_extent_blocks(map);
+		}
+	    }
+	    if (!reserve_blocks(need))
+	    {
+		// nearly full: let the direct path report how much fits
+		dirty_flush(d);
+		pthread_mutex_unlock(&d->lock);
+		return write_through(inumber, data, length, offset);
+	    }
+	    d->reserved += need;
+	    memset(dest, 0, DISK_BLOCK_SIZE);
+	}
+	else if (offset > (long)i * DISK_BLOCK_SIZE || offset + length < (long)(i + 1) * DISK_BLOCK_SIZE)
+	{
+	    cache_read(b, dest);
+	}
+	d->count++;
+    }
+
+    memcpy(d->buf + (offset - (long)d->first * DISK_BLOCK_SIZE), data, length);
+    if (offset + length > d->end)
+    {
+	d->end = offset + length;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return length;
+}
+
+/* write data to a valid inode; it is buffered and reaches the disk on fs_fsync, fs_unmount or when the buffer fills */
+int fs_write( int inumber, const char *data, int length, long offset )
+{
+    struct fs_map map;
+    map.inumber = 0;
+    return write_map(&map, inumber, data, length, offset);
+}
+
+/* write through a map that is reloaded only if its inode changed */
+static int write_map( struct fs_map *map, int inumber, const char *data, int length, long offset )
+{
+    if (!disk.mounted)
+    {
+	return 0;
+    }
+
+    pthread_rwlock_t *lock = inode_lock(inumber);
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_WRITE);
+    txn_enter();
+    pthread_rwlock_wrlock(lock);
+    int result = write_buffered(map, inumber, data, length, offset);
+    pthread_rwlock_unlock(lock);
+    txn_leave(result > 0);
+    stats_end(&span);
+    return result;
+}
+
+/*
+Open files. A handle keeps the inode and its pointer blocks from one
+call to the next, so streaming through a file only costs data block I/O;
+the map is reloaded only when the inode changes underneath it. A handle
+must not be used by two threads at once.
+*/
+
+/* open a valid inode with the cursor at the start, returns 0 on failure */
+struct fs_file *fs_open( int inumber )
+{
+    if (fs_getsize(inumber) < 0)
+    {
+	return 0;
+    }
+
+    struct fs_file *file = malloc(sizeof(struct fs_file));
+    if (!file)
+    {
+	return 0;
+    }
+    file->inumber = inumber;
+    file->offset = 0;
+    file->map.inumber = 0;
+    return file;
+}
+
+/* release a handle, first flushing the writes still buffered for its inode; they are not committed until fs_fsync or fs_commit */
+int fs_close( struct fs_file *file )
+{
+    if (!file)
+    {
+	return 0;
+    }
+
+    int ok = 1;
+    int inumber = file->inumber;
+    free(file);
+    if (disk.mounted && dirty_holds(inumber))
+    {
+	pthread_rwlock_t *lock = inode_lock(inumber);
+	struct stats_span span;
+	stats_begin(&span, STATS_OP_WRITE);
+	txn_enter();
+	pthread_rwlock_wrlock(lock);
+	ok = dirty_flush_inode(inumber);
+	pthread_rwlock_unlock(lock);
+	txn_leave(1);
+	stats_end(&span);
+    }
+    return ok;
+}
+
+/* read at the cursor and move it past what was read */
+int fs_file_read( struct fs_file *file, char *data, int length )
+{
+    int result = read_map(&file->map, file->inumber, data, length, file->offset);
+    file->offset += result;
+    return result;
+}
+
+/* write at the cursor and move it past what was written */
+int fs_file_write( struct fs_file *file, const char *data, int length )
+{
+    int result = write_map(&file->map, file->inumber, data, length, file->offset);
+    file->offset += result;
+    return result;
+}
+
+/* move the cursor to the end of the file, then write there */
+int fs_file_append( struct fs_file *file, const char *data, int length )
+{
+    long size = fs_getsize(file->inumber);
+    if (size < 0)
+    {
+	return 0;
+    }
+    file->offset = size;
+    return fs_file_write(file, data, length);
+}
+
+/* place the cursor relative to the start, the cursor or the end; returns the new offset or -1 */
+long fs_file_seek( struct fs_file *file, long offset, int whence )
+{
+    long base = 0;
+    if (whence == FS_SEEK_CUR)
+    {
+	base = file->offset;
+    }
+    else if (whence == FS_SEEK_END)
+    {
+	base = fs_getsize(file->inumber);
+	if (base < 0)
+	{
+	    return -1;
+	}
+    }
+    else if (whence != FS_SEEK_SET)
+    {
+	return -1;
+    }
+
+    if (base + offset < 0)
+    {
+	return -1;
+    }
+    file->offset = base + offset;
+    return file->offset;
+}
+
+/* write the buffered data of an inode to disk, along with everything else not committed yet */
+int fs_fsync( int inumber )
+{
+    if (!disk.mounted || fs_getsize(inumber) < 0)
+    {
+	return 0;
+    }
+
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_FSYNC);
+    int ok = txn_commit(1);
+    stats_end(&span);
+    return ok;
+}
+
+/* open a batch: changes stay in memory until the matching fs_commit */
+int fs_begin()
+{
+    if (!disk.mounted)
+    {
+	return 0;
+    }
+
+    pthread_mutex_lock(&txn_lock);
+    txn_depth++;
+    pthread_mutex_unlock(&txn_lock);
+    return 1;
+}
+
+/* close a batch; closing the outermost one (or calling without fs_begin) commits everything changed so far */
+int fs_commit()
+{
+    if (!disk.mounted)
+    {
+	return 0;
     }
 
-    disk_read(nblock, block.data);
-    if(!block.inodes[inumber].isvalid)
+    pthread_mutex_lock(&txn_lock);
+    if (txn_depth > 0)
     {
-	return -1;
+	txn_depth--;
+    }
+    int now = !txn_depth;
+    pthread_mutex_unlock(&txn_lock);
+
+    return !now || txn_commit(1);
+}
+
+/*
+Directories are files of extendible hash buckets. Block 0 is the
+header, blocks 1..DIR_INDEX_BLOCKS hold an index of 2^depth bucket block
+numbers picked by the low bits of the name hash, and the buckets follow.
+A full bucket splits on its next hash bit, doubling the index when it
+has no bit left, so a lookup reads the header, one index block and one
+bucket however big the directory grows. Directory blocks go through the
+cache as metadata and reach the disk with the next commit. Every
+directory call holds the namespace lock; names found are remembered in
+the dentry cache.
+
+An entry records the generation of the inode it was made for. fs_delete
+leaves the names of an inode behind, and once the inode is deleted or
+made again for another file they no longer match: lookups and readdir
+pass over such a name, a new file by that name takes its slot, and
+fs_unlink removes just the name. The generation is 24 bits, so only an
+inode created 2^24 times over between two uses of a stale name could
+fool it.
+*/
+
+/* FNV-1a */
+static unsigned name_hash( const char *name )
+{
+    unsigned h = 2166136261u;
+    for (; *name; name++)
+    {
+	h = (h ^ (unsigned char)*name) * 16777619u;
     }
+    return h;
+}
 
-    return block.inodes[inumber].size;
+static struct fs_dentry *dcache_slot( int parent, unsigned hash )
+{
+    return &dcache[(hash ^ (unsigned)parent * 2654435761u) % DCACHE_SLOTS];
 }
 
-/* read data from a valid inode */
-int fs_read( int inumber, char *data, int length, int offset )
+static int dcache_find( int parent, const char *name, unsigned hash, unsigned *gen )
 {
-    if (!disk.mounted) {
+    struct fs_dentry *d = dcache_slot(parent, hash);
+    if (d->parent != parent || strcmp(d->name, name))
+    {
 	return 0;
     }
+    *gen = d->gen;
+    return d->inumber;
+}
+
+static void dcache_add( int parent, const char *name, unsigned hash, int inumber, unsigned gen )
+{
+    struct fs_dentry *d = dcache_slot(parent, hash);
+    d->parent = parent;
+    d->inumber = inumber;
+    d->gen = gen;
+    strcpy(d->name, name);
+}
+
+static void dcache_drop( int parent, const char *name, unsigned hash )
+{
+    struct fs_dentry *d = dcache_slot(parent, hash);
+    if (d->parent == parent && !strcmp(d->name, name))
+    {
+	d->parent = 0;
+    }
+}
 
-    union fs_block block;
-    struct fs_inode inode;
+static int inode_is_dir( int inumber )
+{
+    struct fs_inode *inode = inode_get(inumber);
+    return inode && (inode->isvalid & INODE_TYPE) == INODE_DIR;
+}
 
-    disk_read(0, block.data);
-
-    if(inumber > block.super.ninodes || inumber < 0){
-        //returns an error for the invalid inode number
-	return 0;
-    }
-
-    //int totalinodes = (block.super.ninodeblocks*INODES_PER_BLOCK);
-
-    int i, j;
-    int current_byte = 0;
-    int first = 0;
-
-    disk_read((int) (inumber/INODES_PER_BLOCK) + 1, block.data);
-
-    inode = block.inodes[inumber%INODES_PER_BLOCK];
-
-    if (inode.isvalid == 0) {
-        //return error if the value is 0 -- needs to be valid
-	 return 0;
-    }
-    if(offset >= inode.size){
-        return 0;
-    }
-
-    int startBlock = (int)(offset/DISK_BLOCK_SIZE);
-    //Find offset per block -- by moding for 4096 -- find block
-    int current_offset = offset%4096;
-    for(i = startBlock; i < POINTERS_PER_INODE; i++){
-        if(inode.direct[i]){
-            if (first == 0) {
-                disk_read(inode.direct[i], block.data);
-                for(j = 0; j+current_offset < DISK_BLOCK_SIZE; j++){
-                    if(block.data[j+current_offset]){
-                        data[current_byte] = block.data[j+current_offset];
-                        current_byte++;
-                        if(current_byte+offset >= inode.size){
-                            return current_byte;
-                        }
-                    }
-                    else{
-                        return current_byte;
-                    }
-                        //At the end
-                        if (current_byte == length){
-                        return current_byte;
-                    }
-                }
-                first = 1;
-            }
-        //Without the offset
-            else {
-                disk_read(inode.direct[i], block.data);
-                for(j = 0; j < DISK_BLOCK_SIZE; j++){
-                    if(block.data[j]){
-                        data[current_byte] = block.data[j];
-                        current_byte++;
-                        if(current_byte+offset >= inode.size){
-                            return current_byte;
-                        }
-
-                    }
-                    else{
-                        return current_byte;
-                    }
-                    if (current_byte == length){
-                        return current_byte;
-                    }
-                }
-            }
-        }
-    }
-
-    //Indirect nodes get the data
-    //create an indirect block
-    
-    union fs_block indirectBlock;
-    int startIndirect = startBlock - 5;
-    if(inode.indirect)
-    {
-        disk_read(inode.indirect, indirectBlock.data);
-        for(i = startIndirect; i < POINTERS_PER_BLOCK; i++)
-        {
-            if (indirectBlock.pointers[i])
-            {
-                disk_read(indirectBlock.pointers[i], block.data);
-                //do same thingfor read
-                for(j = 0; j < DISK_BLOCK_SIZE; j++){
-                    if(block.data[j]){
-                        data[current_byte] = block.data[j];
-                        current_byte++;
-                        if(current_byte+offset >= inode.size){
-                            return current_byte;
-                        }
-
-                    }
-                    else{
-                        return current_byte;
-                    }
-                    if (current_byte == length){
-                        return current_byte;
-                    }
-                }
-            }
-        }
-    }
-    return current_byte;
-}
-
-/* write data to a valid inode */
-int fs_write( int inumber, const char *data, int length, int offset )
+static unsigned inode_gen( int inumber )
 {
-    union fs_block block;
-    int i, j;
-    int current_byte = 0;
+    struct fs_inode *inode = inode_get(inumber);
+    return inode ? (unsigned)inode->isvalid >> INODE_GEN_SHIFT : 0;
+}
 
-    if (!disk.mounted)
+/* whether inumber is still the inode a name of generation gen was made for */
+static int inode_names( int inumber, unsigned gen )
+{
+    struct fs_inode *inode = inode_get(inumber);
+    return inode && (inode->isvalid & INODE_TYPE) && (unsigned)inode->isvalid >> INODE_GEN_SHIFT == gen;
+}
+
+/* read file block fblock of a directory; blocks never written read as zeros */
+static void dir_read( struct fs_map *map, int fblock, union fs_block *block )
+{
+    int b = map_block(map, fblock);
+    if (b)
+    {
+	cache_read(b, block->data);
+    }
+    else
+    {
+	memset(block->data, 0, DISK_BLOCK_SIZE);
+    }
+}
+
+/* write file block fblock of a directory, mapping it (and for extents, the blocks before it) first */
+static int dir_write( struct fs_map *map, int fblock, union fs_block *block )
+{
+    int b = map_block(map, fblock);
+    if (!b)
+    {
+	union fs_block zero;
+	memset(zero.data, 0, DISK_BLOCK_SIZE);
+	for (int i = disk.extents ? map_extent_blocks(map) : fblock; i <= fblock; i++)
+	{
+	    b = map_alloc(map, i, 0);
+	    if (!b)
+	    {
+		map_save(map);
+		return 0;
+	    }
+	    stats_set_class(b, 1, STATS_DIR);
+	    if (i < fblock)
+	    {
+		cache_write_meta(b, zero.data);
+	    }
+	}
+	if ((long)(fblock + 1) * DISK_BLOCK_SIZE > inode_size(&map->inode))
+	{
+	    inode_set_size(&map->inode, (long)(fblock + 1) * DISK_BLOCK_SIZE);
+	}
+	map_save(map);
+    }
+    cache_write_meta(b, block->data);
+    return 1;
+}
+
+/* bucket block for hash, read into bucket; returns 0 for an empty directory */
+static int dir_bucket( struct fs_map *map, union fs_block *head, unsigned hash, union fs_block *bucket )
+{
+    union fs_block index;
+
+    dir_read(map, 0, head);
+    if (head->dir.magic != DIR_MAGIC)
     {
-//	printf("disk not mounted\n");
 	return 0;
     }
-    
-    // scan for free blocks in bitmap
-    int bm_loc = 0;
 
-    disk_read(0, block.data);
-    int blocks = block.super.nblocks;
+    unsigned i = hash & ((1u << head->dir.depth) - 1);
+    dir_read(map, 1 + i / POINTERS_PER_BLOCK, &index);
+    int fblock = index.pointers[i % POINTERS_PER_BLOCK];
+    dir_read(map, fblock, bucket);
+    return fblock;
+}
 
-    for (i=0; i < block.super.nblocks; i++)
+/* position of name in a bucket, or -1 */
+static int bucket_find( union fs_block *bucket, const char *name, unsigned hash )
+{
+    for (int i = 0; i < bucket->bucket.count; i++)
     {
-	if (bitmap[i] == 0)
+	struct fs_dirent *e = &bucket->bucket.entries[i];
+	if (e->hash == hash && !strcmp(e->name, name))
 	{
-	    bm_loc = i;
-	    break;
+	    return i;
 	}
     }
+    return -1;
+}
 
-    if(inumber > block.super.ninodes || inumber < 0){
-        //returns an error for the invalid inode number
-	return 0;
+/* copy the first half of the index over the second, one more hash bit per lookup */
+static int dir_double( struct fs_map *map, int depth )
+{
+    union fs_block index;
+    int n = 1 << depth;
+
+    if (n < POINTERS_PER_BLOCK)
+    {
+	dir_read(map, 1, &index);
+	memcpy(&index.pointers[n], &index.pointers[0], n * sizeof(int));
+	return dir_write(map, 1, &index);
     }
 
-    int inode = (int)(inumber%INODES_PER_BLOCK);
-    int num = (int)(inode/INODES_PER_BLOCK) + 1;
-    disk_read(num, block.data);
+    for (int j = 0; j < n / POINTERS_PER_BLOCK; j++)
+    {
+	dir_read(map, 1 + j, &index);
+	if (!dir_write(map, 1 + n / POINTERS_PER_BLOCK + j, &index))
+	{
+	    return 0;
+	}
+    }
+    return 1;
+}
 
+/*
+split the bucket at fblock, whose index entries end in pattern, on its
+next hash bit: names with the bit set move to a new bucket at fresh,
+and the index entries for them are pointed there.
+*/
+static int dir_split( struct fs_map *map, int fblock, union fs_block *bucket, int fresh, unsigned pattern, int depth )
+{
+    union fs_block moved, index;
+    int local = bucket->bucket.depth;
+    int kept = 0;
 
-    if (block.inodes[inode].isvalid == 0) {
+    memset(moved.data, 0, DISK_BLOCK_SIZE);
+    moved.bucket.depth = local + 1;
+    for (int i = 0; i < bucket->bucket.count; i++)
+    {
+	struct fs_dirent *e = &bucket->bucket.entries[i];
+	if (e->hash >> local & 1)
+	{
+	    moved.bucket.entries[moved.bucket.count++] = *e;
+	}
+	else
+	{
+	    bucket->bucket.entries[kept++] = *e;
+	}
+    }
+    memset(&bucket->bucket.entries[kept], 0, (bucket->bucket.count - kept) * sizeof(struct fs_dirent));
+    bucket->bucket.count = kept;
+    bucket->bucket.depth = local + 1;
+    if (!dir_write(map, fresh, &moved) || !dir_write(map, fblock, bucket))
+    {
 	return 0;
     }
-    
-    // start at starting block
-    int startBlock = (int)(offset/DISK_BLOCK_SIZE);
 
-
-    if (block.inodes[inode].direct[startBlock] == 0)
+    int loaded = 0;
+    for (unsigned i = pattern | 1u << local; i < 1u << depth; i += 2u << local)
     {
-	block.inodes[inode].direct[startBlock] = bm_loc;
-	bitmap[bm_loc] = 1;
+	int iblock = 1 + i / POINTERS_PER_BLOCK;
+	if (iblock != loaded)
+	{
+	    if (loaded && !dir_write(map, loaded, &index))
+	    {
+		return 0;
+	    }
+	    dir_read(map, iblock, &index);
+	    loaded = iblock;
+	}
+	index.pointers[i % POINTERS_PER_BLOCK] = fresh;
     }
+    return dir_write(map, loaded, &index);
+}
 
-    union fs_block direct;
+/* add a name to a directory the caller holds exclusively, or point a name left behind by fs_delete at inumber */
+static int dir_insert( struct fs_map *map, const char *name, unsigned hash, int inumber, unsigned gen )
+{
+    union fs_block head, bucket;
 
-    int current_offset = offset%4096;
-    for (i = startBlock; i < POINTERS_PER_INODE; i++) {
-	if (block.inodes[inode].direct[i] > 0) {
-	    disk_read(block.inodes[inode].direct[i], direct.data);	    
-	    for (j = 0; j+current_offset < DISK_BLOCK_SIZE; j++) {
-		direct.data[current_byte] =  data[j+current_offset];
-		current_byte++;
-		if (current_byte > length) {
-		    current_byte--; // Finish off block with trailing 0s
-		}
+    int fblock = dir_bucket(map, &head, hash, &bucket);
+    int i = fblock ? bucket_find(&bucket, name, hash) : -1;
+    if (i >= 0)
+    {
+	bucket.bucket.entries[i].inumber = inumber;
+	bucket.bucket.entries[i].gen = gen;
+	return dir_write(map, fblock, &bucket);
+    }
+    if (!fblock)
+    {
+	// the first name: one bucket that every hash leads to
+	union fs_block index;
+	memset(head.data, 0, DISK_BLOCK_SIZE);
+	head.dir.magic = DIR_MAGIC;
+	head.dir.nbuckets = 1;
+	memset(index.data, 0, DISK_BLOCK_SIZE);
+	fblock = index.pointers[0] = DIR_INDEX_BLOCKS + 1;
+	memset(bucket.data, 0, DISK_BLOCK_SIZE);
+	if (!dir_write(map, 1, &index))
+	{
+	    return 0;
+	}
+    }
+
+    while (bucket.bucket.count == DIRENTS_PER_BLOCK)
+    {
+	// no bit left to split on: double the index first
+	unsigned pattern = hash & ((1u << bucket.bucket.depth) - 1);
+	if (bucket.bucket.depth == head.dir.depth)
+	{
+	    if (head.dir.depth == DIR_MAX_DEPTH || !dir_double(map, head.dir.depth))
+	    {
+		return 0;
 	    }
-	    disk_write(block.inodes[inode].direct[i], direct.data);
+	    head.dir.depth++;
 	}
-	else if (i < POINTERS_PER_INODE)
+
+	int fresh = DIR_INDEX_BLOCKS + 1 + head.dir.nbuckets;
+	if (!dir_split(map, fblock, &bucket, fresh, pattern, head.dir.depth))
 	{
-	    if (current_byte == length) {
-		break;
+	    return 0;
+	}
+	head.dir.nbuckets++;
+	if (!dir_write(map, 0, &head))
+	{
+	    return 0;
+	}
+	fblock = dir_bucket(map, &head, hash, &bucket);
+    }
+
+    struct fs_dirent *e = &bucket.bucket.entries[bucket.bucket.count++];
+    e->inumber = inumber;
+    e->gen = gen;
+    e->hash = hash;
+    strncpy(e->name, name, FS_NAME_MAX + 1);
+    head.dir.count++;
+    return dir_write(map, fblock, &bucket) && dir_write(map, 0, &head);
+}
+
+/* take a name out of a directory the caller holds exclusively; buckets are not merged back */
+static int dir_remove( struct fs_map *map, const char *name, unsigned hash )
+{
+    union fs_block head, bucket;
+
+    int fblock = dir_bucket(map, &head, hash, &bucket);
+    int i = fblock ? bucket_find(&bucket, name, hash) : -1;
+    if (i < 0)
+    {
+	return 0;
+    }
+
+    struct fs_dir_bucket *b = &bucket.bucket;
+    b->entries[i] = b->entries[--b->count];
+    memset(&b->entries[b->count], 0, sizeof(struct fs_dirent));
+    head.dir.count--;
+    return dir_write(map, fblock, &bucket) && dir_write(map, 0, &head);
+}
+
+/* the entry for a name in a directory, from the dentry cache when it has it; 0 if there is none */
+static int dir_entry( int dir, const char *name, unsigned hash, unsigned *gen )
+{
+    int inumber = dcache_find(dir, name, hash, gen);
+
+    if (!inumber)
+    {
+	union fs_block head, bucket;
+	struct fs_map map;
+
+	pthread_rwlock_rdlock(inode_lock(dir));
+	if (map_load(&map, dir) && (map.inode.isvalid & INODE_TYPE) == INODE_DIR && dir_bucket(&map, &head, hash, &bucket))
+	{
+	    int i = bucket_find(&bucket, name, hash);
+	    if (i >= 0)
+	    {
+		inumber = bucket.bucket.entries[i].inumber;
+		*gen = bucket.bucket.entries[i].gen;
 	    }
-	    
-	    // Get new block
-	    
-	    int found_bl = 0;
+	}
+	pthread_rwlock_unlock(inode_lock(dir));
+	if (inumber)
+	{
+	    dcache_add(dir, name, hash, inumber, *gen);
+	}
+    }
+    return inumber;
+}
+
+/* the inode a name in a directory leads to, 0 if none or if it was left behind by fs_delete */
+static int dir_lookup( int dir, const char *name )
+{
+    unsigned gen;
+    int inumber = dir_entry(dir, name, name_hash(name), &gen);
+    return inumber && inode_names(inumber, gen) ? inumber : 0;
+}
+
+/* copy up to max names of a directory into entries (when given), passing over the ones fs_delete left behind; returns how many */
+static int dir_names( struct fs_map *map, struct fs_dirent *entries, int max )
+{
+    union fs_block head, bucket;
+    int count = 0;
 
-	    for (int k=0; k < blocks; k++) 
+    dir_read(map, 0, &head);
+    if (head.dir.magic != DIR_MAGIC)
+    {
+	return 0;
+    }
+    for (int b = 0; b < head.dir.nbuckets && count < max; b++)
+    {
+	dir_read(map, DIR_INDEX_BLOCKS + 1 + b, &bucket);
+	for (int i = 0; i < bucket.bucket.count && count < max; i++)
+	{
+	    struct fs_dirent *e = &bucket.bucket.entries[i];
+	    if (inode_names(e->inumber, e->gen))
 	    {
-		if (bitmap[k] == 0)
+		if (entries)
 		{
-		    found_bl = 1;
-		    bm_loc = k;
-		    break;
+		    entries[count] = *e;
 		}
+		count++;
 	    }
-	    
-	    if (!found_bl)
-	    {
-		// No free blocks found
-		break;
-	    }
+	}
+    }
+    return count;
+}
 
-	    block.inodes[inode].direct[i] = bm_loc;
-	    bitmap[bm_loc] = 1;
-	    disk_write(num, block.data); 
-	    
-	    disk_read(bm_loc, direct.data);	    
-	    
-	    for (j = 0; j+current_offset < DISK_BLOCK_SIZE; j++) {
-		if (current_byte <= length) {
-		    direct.data[current_byte-(4096*i)] =  data[j+current_offset+(4096&i)];
-		}
-		current_byte++;
-		if (current_byte > length) {
-		    direct.data[current_byte-(4096*i)] = 0;
-		    current_byte--; // Finish off block with trailing 0s
-		}
+/* the directory holding the last component of path, which is copied to name (empty for the root) */
+static int path_parent( const char *path, char *name )
+{
+    int dir = FS_ROOT_INODE;
+
+    name[0] = 0;
+    if (!inode_is_dir(dir))
+    {
+	return 0;
+    }
+
+    while (1)
+    {
+	while (*path == '/')
+	{
+	    path++;
+	}
+	int len = strcspn(path, "/");
+	if (!len)
+	{
+	    return dir;
+	}
+	if (len > FS_NAME_MAX)
+	{
+	    return 0;
+	}
+	memcpy(name, path, len);
+	name[len] = 0;
+
+	path += len;
+	while (*path == '/')
+	{
+	    path++;
+	}
+	if (!*path)
+	{
+	    return dir;
+	}
+	dir = dir_lookup(dir, name);
+	if (!inode_is_dir(dir))
+	{
+	    return 0;
+	}
+    }
+}
+
+/* return the inode a path names, the root for "/", or 0 */
+int fs_lookup( const char *path )
+{
+    char name[FS_NAME_MAX + 1];
+
+    if (!disk.mounted)
+    {
+	return 0;
+    }
+
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_LOOKUP);
+    pthread_mutex_lock(&namespace_lock);
+    txn_enter();
+    int dir = path_parent(path, name);
+    int inumber = dir && name[0] ? dir_lookup(dir, name) : dir;
+    txn_leave(0);
+    pthread_mutex_unlock(&namespace_lock);
+    stats_end(&span);
+    return inumber;
+}
+
+/* create an empty file or directory under a new name in an existing directory */
+static int make_node( const char *path, int type )
+{
+    char name[FS_NAME_MAX + 1];
+
+    if (!disk.mounted)
+    {
+	return 0;
+    }
+
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_LINK);
+    pthread_mutex_lock(&namespace_lock);
+    txn_enter();
+
+    // a name whose inode is gone is free to take; dir_insert reuses its entry
+    int node = 0;
+    int dir = path_parent(path, name);
+    if (dir && name[0] && strcmp(name, ".") && strcmp(name, "..") && !dir_lookup(dir, name))
+    {
+	node = create_inode(type);
+    }
+    if (node)
+    {
+	unsigned hash = name_hash(name);
+	unsigned gen = inode_gen(node);
+	struct fs_map map;
+
+	pthread_rwlock_wrlock(inode_lock(dir));
+	int ok = map_load(&map, dir) && dir_insert(&map, name, hash, node, gen);
+	pthread_rwlock_unlock(inode_lock(dir));
+	if (ok)
+	{
+	    dcache_add(dir, name, hash, node, gen);
+	}
+	else
+	{
+	    delete_inode(node, 1, gen);
+	    node = 0;
+	}
+    }
+
+    txn_leave(node != 0);
+    pthread_mutex_unlock(&namespace_lock);
+    stats_end(&span);
+    return node;
+}
+
+/* create an empty file at path, returns its inode or 0 if the name is taken or its directory missing */
+int fs_create_path( const char *path )
+{
+    return make_node(path, INODE_FILE);
+}
+
+/* create an empty directory at path, returns its inode or 0 */
+int fs_mkdir( const char *path )
+{
+    return make_node(path, INODE_DIR);
+}
+
+/* remove a name and delete its inode; directories must be empty, and a name left behind by fs_delete just goes */
+int fs_unlink( const char *path )
+{
+    char name[FS_NAME_MAX + 1];
+
+    if (!disk.mounted)
+    {
+	return 0;
+    }
+
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_UNLINK);
+    pthread_mutex_lock(&namespace_lock);
+    txn_enter();
+
+    int ok = 0;
+    unsigned gen;
+    int dir = path_parent(path, name);
+    unsigned hash = name_hash(name);
+    int entry = dir && name[0] ? dir_entry(dir, name, hash, &gen) : 0;
+    int node = entry && inode_names(entry, gen) ? entry : 0;
+    int empty = entry && !inode_is_dir(node);
+    if (node && !empty)
+    {
+	struct fs_map map;
+
+	pthread_rwlock_rdlock(inode_lock(node));
+	empty = map_load(&map, node) && !dir_names(&map, 0, 1);
+	pthread_rwlock_unlock(inode_lock(node));
+    }
+    // fs_delete and fs_create don't take the namespace lock, so the inode may have been made again since
+    // the name was checked; it goes only while it is still the one the name was made for
+    if (empty && node && !delete_inode(node, 1, gen))
+    {
+	empty = 0;
+    }
+    if (empty)
+    {
+	struct fs_map map;
+
+	pthread_rwlock_wrlock(inode_lock(dir));
+	ok = map_load(&map, dir) && dir_remove(&map, name, hash);
+	pthread_rwlock_unlock(inode_lock(dir));
+	if (ok)
+	{
+	    dcache_drop(dir, name, hash);
+	}
+    }
+
+    txn_leave(ok);
+    pthread_mutex_unlock(&namespace_lock);
+    stats_end(&span);
+    return ok;
+}
+
+/* call fn for every name in the directory at path, in no particular order; returns how many, or -1 */
+int fs_readdir( const char *path, void (*fn)( const char *name, int inumber, void *arg ), void *arg )
+{
+    char name[FS_NAME_MAX + 1];
+    struct fs_dirent *entries = 0;
+    int count = -1;
+
+    if (!disk.mounted)
+    {
+	return -1;
+    }
+
+    // the names are gathered first, so fn may call back into the filesystem
+    struct stats_span span;
+    stats_begin(&span, STATS_OP_LOOKUP);
+    pthread_mutex_lock(&namespace_lock);
+    txn_enter();
+    int dir = path_parent(path, name);
+    if (dir && name[0])
+    {
+	dir = dir_lookup(dir, name);
+    }
+    if (inode_is_dir(dir))
+    {
+	union fs_block head;
+	struct fs_map map;
+
+	pthread_rwlock_rdlock(inode_lock(dir));
+	count = 0;
+	if (map_load(&map, dir))
+	{
+	    dir_read(&map, 0, &head);
+	    if (head.dir.magic == DIR_MAGIC && (entries = malloc((head.dir.count + 1) * sizeof(struct fs_dirent))))
+	    {
+		count = dir_names(&map, entries, head.dir.count);
 	    }
-	    disk_write(bm_loc, direct.data);
-	    disk_read(num, block.data);
 	}
+	pthread_rwlock_unlock(inode_lock(dir));
+    }
+    txn_leave(0);
+    pthread_mutex_unlock(&namespace_lock);
+    stats_end(&span);
+
+    for (int i = 0; i < count; i++)
+    {
+	fn(entries[i].name, entries[i].inumber, arg);
     }
-    block.inodes[inode].size = current_byte;
-    disk_write(num, block.data);
-    return current_byte;
+    free(entries);
+    return count;
+}
+
+/* whether an inode is a directory */
+int fs_isdir( int inumber )
+{
+    if (!disk.mounted)
+    {
+	return 0;
+    }
+
+    pthread_rwlock_rdlock(inode_lock(inumber));
+    int dir = inode_is_dir(inumber);
+    pthread_rwlock_unlock(inode_lock(inumber));
+    return dir;
 }
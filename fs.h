@@ -1,15 +1,49 @@
 #ifndef FS_H
 #define FS_H
 
+#define FS_FORMAT_EXTENTS 1 // fs_format_flags: extent based inodes
+#define FS_FORMAT_QUICK   2 // only reset the metadata, leave old data blocks alone
+#define FS_FORMAT_DISCARD 4 // quick, and punch the old data out of the image
+#define FS_FORMAT_LARGE   8 // double and triple indirect blocks, 64-bit sizes; not with EXTENTS
+
+#define FS_ROOT_INODE 1 // the root directory, made by fs_format
+#define FS_NAME_MAX   51 // longest name in a directory
+
+#define FS_SEEK_SET 0 // fs_file_seek: from the start of the file
+#define FS_SEEK_CUR 1 // from the cursor
+#define FS_SEEK_END 2 // from the end of the file
+
+struct fs_file;
+
 void fs_debug();
 int  fs_format();
+int  fs_format_flags( int flags );
 int  fs_mount();
+int  fs_unmount();
+void fs_set_mount_threads( int nthreads );
 
 int  fs_create();
 int  fs_delete( int inumber );
-int  fs_getsize();
+long fs_getsize( int inumber );
+
+int  fs_read( int inumber, char *data, int length, long offset );
+int  fs_write( int inumber, const char *data, int length, long offset );
+int  fs_fsync( int inumber );
+int  fs_begin();
+int  fs_commit();
+
+struct fs_file *fs_open( int inumber );
+int  fs_close( struct fs_file *file );
+int  fs_file_read( struct fs_file *file, char *data, int length );
+int  fs_file_write( struct fs_file *file, const char *data, int length );
+int  fs_file_append( struct fs_file *file, const char *data, int length );
+long fs_file_seek( struct fs_file *file, long offset, int whence );
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+int  fs_lookup( const char *path );
+int  fs_create_path( const char *path );
+int  fs_mkdir( const char *path );
+int  fs_unlink( const char *path );
+int  fs_readdir( const char *path, void (*fn)( const char *name, int inumber, void *arg ), void *arg );
+int  fs_isdir( int inumber );
 
 #endif
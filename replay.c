@@ -0,0 +1,175 @@
+
+/*
+Replay a block trace recorded with simplefs -t against an image, to see
+how a backend or queue depth copes with a real access pattern. Requests
+are issued at the times they were recorded, or back to back with -f.
+Writes store zeros, so replay onto a scratch image. The image must
+already exist with at least as many blocks as the trace; it is never
+created or resized.
+*/
+
+#include "disk.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+static struct disk_trace_record *load_trace( const char *filename, struct disk_trace_header *header, long *n );
+
+int main( int argc, char *argv[] )
+{
+	struct disk_trace_header header;
+	struct disk_trace_record *records;
+	struct disk_request *reqs;
+	char *buffers;
+	long nrecords, i, blocks=0, start, elapsed, lag=0;
+	int backend = DISK_BACKEND_STDIO;
+	int depth = 0;
+	int fast = 0;
+	int model = DISK_MODEL_NONE;
+	int maxcount = 1;
+	int slots;
+
+	for(i=3;i<argc;i++) {
+		if(!strcmp(argv[i],"-q") && i+1<argc) {
+			depth = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-d") && i+1<argc) {
+			model = disk_model_parse(argv[++i]);
+			if(model<0) {
+				printf("unknown device model: %s\n",argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i],"-f")) {
+			fast = 1;
+		} else if(!strcmp(argv[i],"-b") && i+1<argc) {
+			backend = disk_backend_parse(argv[++i]);
+			if(backend<0) {
+				printf("unknown disk backend: %s\n",argv[i]);
+				return 1;
+			}
+		} else {
+			break;
+		}
+	}
+
+	if(argc<3 || i!=argc) {
+		printf("use: %s <tracefile> <diskfile> [-q depth] [-b stdio|mmap|pread|direct] [-d hdd|ssd] [-f]\n",argv[0]);
+		return 1;
+	}
+
+	records = load_trace(argv[1],&header,&nrecords);
+	if(!records) return 1;
+
+	disk_set_model(model);
+
+	if(!disk_open_backend(argv[2],backend)) {
+		printf("couldn't open %s: %s\n",argv[2],strerror(errno));
+		return 1;
+	}
+	if(disk_size()<header.nblocks) {
+		printf("%s has %d blocks, the trace needs %u\n",argv[2],disk_size(),header.nblocks);
+		return 1;
+	}
+
+	if(!disk_aio_init(depth)) {
+		printf("couldn't start %d disk workers\n",depth);
+		return 1;
+	}
+
+	// one request and buffer per slot of queue depth, reused round robin
+	for(i=0;i<nrecords;i++) {
+		if(records[i].count>maxcount) maxcount = records[i].count;
+	}
+	slots = depth>0 ? depth : 1;
+	reqs = calloc(slots,sizeof(struct disk_request));
+	if(!reqs || posix_memalign((void **)&buffers,DISK_BLOCK_SIZE,(size_t)slots*maxcount*DISK_BLOCK_SIZE)) {
+		printf("couldn't allocate %d buffers of %d blocks\n",slots,maxcount);
+		return 1;
+	}
+	memset(buffers,0,(size_t)slots*maxcount*DISK_BLOCK_SIZE);
+	for(i=0;i<slots;i++) reqs[i].done = 1;
+
+	printf("replaying %ld requests on %s with %d blocks (%s)%s\n",nrecords,argv[2],disk_size(),disk_backend_name(),fast ? " as fast as possible" : "");
+
+	start = stats_now();
+	for(i=0;i<nrecords;i++) {
+		struct disk_trace_record *r = &records[i];
+		struct disk_request *req = &reqs[i%slots];
+
+		if(r->blocknum+r->count>header.nblocks) {
+			printf("skipping request past the end of the disk: block %u\n",r->blocknum);
+			continue;
+		}
+
+		if(!fast) {
+			long behind = stats_now()-start-(long)r->time;
+			if(behind<0) {
+				struct timespec t = { -behind/1000000000L, -behind%1000000000L };
+				nanosleep(&t,0);
+			} else if(behind>lag) {
+				lag = behind;
+			}
+		}
+
+		disk_wait(req,1);
+		req->blocknum = r->blocknum;
+		req->count = r->count;
+		req->write = r->write;
+		req->data = buffers+(size_t)(i%slots)*maxcount*DISK_BLOCK_SIZE;
+		stats_set_op(r->op<STATS_OPS ? r->op : STATS_OP_NONE);
+		disk_submit(req,1);
+		blocks += r->count;
+	}
+	disk_wait(reqs,slots);
+	elapsed = stats_now()-start;
+
+	printf("%ld blocks in %.3f s (trace covered %.3f s)\n",blocks,elapsed/1e9,nrecords ? records[nrecords-1].time/1e9 : 0.0);
+	printf("%.1f MB/s, %.0f requests/s\n",blocks*(double)DISK_BLOCK_SIZE/1e6/(elapsed/1e9),nrecords/(elapsed/1e9));
+	if(!fast) printf("%.3f ms most behind schedule\n",lag/1e6);
+	stats_print(stdout);
+
+	disk_close();
+	free(buffers);
+	free(reqs);
+	free(records);
+
+	return 0;
+}
+
+static struct disk_trace_record *load_trace( const char *filename, struct disk_trace_header *header, long *n )
+{
+	struct disk_trace_record *records;
+	FILE *file;
+	long size;
+
+	file = fopen(filename,"r");
+	if(!file) {
+		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
+
+	if(fread(header,sizeof(*header),1,file)!=1 || header->magic!=DISK_TRACE_MAGIC) {
+		printf("%s is not a simplefs trace\n",filename);
+		fclose(file);
+		return 0;
+	}
+
+	fseek(file,0,SEEK_END);
+	size = ftell(file)-sizeof(*header);
+	fseek(file,sizeof(*header),SEEK_SET);
+
+	*n = size/sizeof(struct disk_trace_record);
+	records = malloc((*n ? *n : 1)*sizeof(struct disk_trace_record));
+	if(!records || fread(records,sizeof(struct disk_trace_record),*n,file)!=*n) {
+		printf("couldn't read %s\n",filename);
+		free(records);
+		fclose(file);
+		return 0;
+	}
+
+	fclose(file);
+	return records;
+}
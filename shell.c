@@ -1,181 +1,464 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 
+static int do_command( const char *line );
+static int run_line( const char *line );
+static int time_command( const char *line );
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int inode_arg( const char *arg );
+static void print_dirent( const char *name, int inumber, void *arg );
+static int format_option( const char *opt );
 
 int main( int argc, char *argv[] )
 {
 	char line[1024];
-	char cmd[1024];
-	char arg1[1024];
-	char arg2[1024];
-	int inumber, result, args;
+	int i;
+	int cacheblocks = CACHE_DEFAULT_CAPACITY;
+	int backend = DISK_BACKEND_STDIO;
+	int depth = 0;
+	const char *tracename = 0;
+	int model = DISK_MODEL_NONE;
+	int timeall = 0;
+	FILE *script = 0;
+	FILE *input = stdin;
+
+	for(i=3;i<argc;i++) {
+		if(!strcmp(argv[i],"-c") && i+1<argc) {
+			cacheblocks = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-m") && i+1<argc) {
+			fs_set_mount_threads(atoi(argv[++i]));
+		} else if(!strcmp(argv[i],"-q") && i+1<argc) {
+			depth = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-d") && i+1<argc) {
+			model = disk_model_parse(argv[++i]);
+			if(model<0) {
+				printf("unknown device model: %s\n",argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i],"-f") && i+1<argc) {
+			script = fopen(argv[++i],"r");
+			if(!script) {
+				printf("couldn't open %s: %s\n",argv[i],strerror(errno));
+				return 1;
+			}
+			input = script;
+		} else if(!strcmp(argv[i],"-T")) {
+			timeall = 1;
+		} else if(!strcmp(argv[i],"-t") && i+1<argc) {
+			tracename = argv[++i];
+		} else if(!strcmp(argv[i],"-b") && i+1<argc) {
+			backend = disk_backend_parse(argv[++i]);
+			if(backend<0) {
+				printf("unknown disk backend: %s\n",argv[i]);
+				return 1;
+			}
+		} else {
+			break;
+		}
+	}
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	if(argc<3 || i!=argc) {
+		printf("use: %s <diskfile> <nblocks> [-c cacheblocks] [-q depth] [-m mountthreads] [-b stdio|mmap|pread|direct] [-d hdd|ssd] [-t tracefile] [-f script] [-T]\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	if(!disk_init_backend(argv[1],atoi(argv[2]),backend)) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	disk_set_model(model);
+
+	if(tracename && !disk_trace_open(tracename)) {
+		printf("couldn't open trace %s: %s\n",tracename,strerror(errno));
+		return 1;
+	}
+
+	if(!disk_aio_init(depth)) {
+		printf("couldn't start %d disk workers\n",depth);
+		return 1;
+	}
+
+	if(!cache_init(cacheblocks)) {
+		printf("couldn't allocate a cache of %d blocks\n",cacheblocks);
+		return 1;
+	}
+
+	printf("opened emulated disk image %s with %d blocks (%s)\n",argv[1],disk_size(),disk_backend_name());
 
 	while(1) {
-		printf(" simplefs> ");
-		fflush(stdout);
-
-		if(!fgets(line,sizeof(line),stdin)) break;
-
-		if(line[0]=='\n') continue;
-		line[strlen(line)-1] = 0;
-
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
-		if(args==0) continue;
-
-		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
-					printf("disk formatted.\n");
-				} else {
-					printf("format failed!\n");
-				}
-			} else {
-				printf("use: format\n");
-			}
-		} else if(!strcmp(cmd,"mount")) {
-			if(args==1) {
-				if(fs_mount()) {
-					printf("disk mounted.\n");
-				} else {
-					printf("mount failed!\n");
-				}
-			} else {
-				printf("use: mount\n");
-			}
-		} else if(!strcmp(cmd,"debug")) {
-			if(args==1) {
-				fs_debug();
-			} else {
-				printf("use: debug\n");
-			}
-		} else if(!strcmp(cmd,"getsize")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
-				} else {
-					printf("getsize failed!\n");
-				}
-			} else {
-				printf("use: getsize <inumber>\n");
-			}
-			
-		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
-				inumber = fs_create();
-				if(inumber>0) {
-					printf("created inode %d\n",inumber);
-				} else {
-					printf("create failed!\n");
-				}
-			} else {
-				printf("use: create\n");
-			}
-		} else if(!strcmp(cmd,"delete")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
-					printf("inode %d deleted.\n",inumber);
-				} else {
-					printf("delete failed!\n");	
-				}
-			} else {
-				printf("use: delete <inumber>\n");
-			}
-		} else if(!strcmp(cmd,"cat")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
-					printf("cat failed!\n");
-				}
-			} else {
-				printf("use: cat <inumber>\n");
-			}
-
-		} else if(!strcmp(cmd,"copyin")) {
-			if(args==3) {
-				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
-					printf("copied file %s to inode %d\n",arg1,inumber);
-				} else {
-					printf("copy failed!\n");
-				}
-			} else {
-				printf("use: copyin <filename> <inumber>\n");
-			}
-
-		} else if(!strcmp(cmd,"copyout")) {
-			if(args==3) {
-				inumber = atoi(arg1);
-				if(do_copyout(inumber,arg2)) {
-					printf("copied inode %d to file %s\n",inumber,arg2);
-				} else {
-					printf("copy failed!\n");
-				}
-			} else {
-				printf("use: copyout <inumber> <filename>\n");
-			}
-
-		} else if(!strcmp(cmd,"help")) {
-			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
-			printf("    debug\n");
-			printf("    create\n");
-			printf("    delete  <inode>\n");
-			printf("    cat     <inode>\n");
-			printf("    copyin  <file> <inode>\n");
-			printf("    copyout <inode> <file>\n");
-			printf("    help\n");
-			printf("    quit\n");
-			printf("    exit\n");
-		} else if(!strcmp(cmd,"quit")) {
-			break;
-		} else if(!strcmp(cmd,"exit")) {
-			break;
-		} else {
-			printf("unknown command: %s\n",cmd);
-			printf("type 'help' for a list of commands.\n");
-			result = 1;
+		if(!script) {
+			printf(" simplefs> ");
+			fflush(stdout);
 		}
+
+		if(!fgets(line,sizeof(line),input)) break;
+
+		i = strlen(line);
+		if(i>0 && line[i-1]=='\n') line[i-1] = 0;
+		if(line[0]=='#') continue;
+
+		if(!(timeall ? time_command(line) : run_line(line))) break;
 	}
 
+	if(script) fclose(script);
+
 	printf("closing emulated disk.\n");
+	fs_unmount();
+	cache_close();
 	disk_close();
 
 	return 0;
 }
 
+/* carry out one shell command; returns 0 if the shell should exit */
+static int do_command( const char *line )
+{
+	char cmd[1024];
+	char arg1[1024];
+	char arg2[1024];
+	int inumber, result, args;
+
+	args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+	if(args<=0) return 1;
+
+	if(!strcmp(cmd,"format")) {
+		result = 0;
+		if(args>=2) result |= format_option(arg1);
+		if(args==3) result |= format_option(arg2);
+		// the two inode formats exclude each other
+		if(result>=0 && (result&FS_FORMAT_EXTENTS) && (result&FS_FORMAT_LARGE)) result = -1;
+		if(result>=0) {
+			if(fs_format_flags(result)) {
+				printf("disk formatted.\n");
+			} else {
+				printf("format failed!\n");
+			}
+		} else {
+			printf("use: format [extents|large] [quick|discard]\n");
+		}
+	} else if(!strcmp(cmd,"mount")) {
+		if(args==1) {
+			if(fs_mount()) {
+				printf("disk mounted.\n");
+			} else {
+				printf("mount failed!\n");
+			}
+		} else {
+			printf("use: mount\n");
+		}
+	} else if(!strcmp(cmd,"unmount")) {
+		if(args==1) {
+			if(fs_unmount()) {
+				printf("disk unmounted.\n");
+			} else {
+				printf("unmount failed!\n");
+			}
+		} else {
+			printf("use: unmount\n");
+		}
+	} else if(!strcmp(cmd,"debug")) {
+		if(args==1) {
+			fs_debug();
+		} else {
+			printf("use: debug\n");
+		}
+	} else if(!strcmp(cmd,"getsize")) {
+		if(args==2) {
+			inumber = inode_arg(arg1);
+			long size = fs_getsize(inumber);
+			if(size>=0) {
+				printf("inode %d has size %ld\n",inumber,size);
+			} else {
+				printf("getsize failed!\n");
+			}
+		} else {
+			printf("use: getsize <inumber|path>\n");
+		}
+		
+	} else if(!strcmp(cmd,"create")) {
+		if(args==1) {
+			inumber = fs_create();
+			if(inumber>0) {
+				printf("created inode %d\n",inumber);
+			} else {
+				printf("create failed!\n");
+			}
+		} else {
+			printf("use: create\n");
+		}
+	} else if(!strcmp(cmd,"delete")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			if(fs_delete(inumber)) {
+				printf("inode %d deleted.\n",inumber);
+			} else {
+				printf("delete failed!\n");	
+			}
+		} else {
+			printf("use: delete <inumber>\n");
+		}
+	} else if(!strcmp(cmd,"fsync")) {
+		if(args==2) {
+			inumber = inode_arg(arg1);
+			if(fs_fsync(inumber)) {
+				printf("inode %d synced.\n",inumber);
+			} else {
+				printf("fsync failed!\n");
+			}
+		} else {
+			printf("use: fsync <inumber|path>\n");
+		}
+	} else if(!strcmp(cmd,"begin")) {
+		if(args==1) {
+			if(fs_begin()) {
+				printf("batch started.\n");
+			} else {
+				printf("begin failed!\n");
+			}
+		} else {
+			printf("use: begin\n");
+		}
+	} else if(!strcmp(cmd,"commit")) {
+		if(args==1) {
+			if(fs_commit()) {
+				printf("committed.\n");
+			} else {
+				printf("commit failed!\n");
+			}
+		} else {
+			printf("use: commit\n");
+		}
+	} else if(!strcmp(cmd,"stats")) {
+		if(args==1) {
+			stats_print(stdout);
+		} else if(args==2 && !strcmp(arg1,"reset")) {
+			stats_reset();
+			printf("stats reset.\n");
+		} else if(args==2) {
+			if(stats_dump(arg1)) {
+				printf("stats written to %s\n",arg1);
+			} else {
+				printf("couldn't write %s: %s\n",arg1,strerror(errno));
+			}
+		} else {
+			printf("use: stats [reset|<file>]\n");
+		}
+	} else if(!strcmp(cmd,"cat")) {
+		if(args==2) {
+			inumber = inode_arg(arg1);
+			if(!do_copyout(inumber,"/dev/stdout")) {
+				printf("cat failed!\n");
+			}
+		} else {
+			printf("use: cat <inumber|path>\n");
+		}
+
+	} else if(!strcmp(cmd,"copyin")) {
+		if(args==3) {
+			// a path that does not exist yet is created
+			inumber = inode_arg(arg2);
+			if(!inumber && !isdigit((unsigned char)arg2[0])) inumber = fs_create_path(arg2);
+			if(do_copyin(arg1,inumber)) {
+				printf("copied file %s to inode %d\n",arg1,inumber);
+			} else {
+				printf("copy failed!\n");
+			}
+		} else {
+			printf("use: copyin <filename> <inumber|path>\n");
+		}
+
+	} else if(!strcmp(cmd,"copyout")) {
+		if(args==3) {
+			inumber = inode_arg(arg1);
+			if(do_copyout(inumber,arg2)) {
+				printf("copied inode %d to file %s\n",inumber,arg2);
+			} else {
+				printf("copy failed!\n");
+			}
+		} else {
+			printf("use: copyout <inumber|path> <filename>\n");
+		}
+
+	} else if(!strcmp(cmd,"lookup")) {
+		if(args==2) {
+			inumber = fs_lookup(arg1);
+			if(inumber>0) {
+				printf("%s is inode %d\n",arg1,inumber);
+			} else {
+				printf("lookup failed!\n");
+			}
+		} else {
+			printf("use: lookup <path>\n");
+		}
+	} else if(!strcmp(cmd,"touch")) {
+		if(args==2) {
+			inumber = fs_create_path(arg1);
+			if(inumber>0) {
+				printf("created %s as inode %d\n",arg1,inumber);
+			} else {
+				printf("touch failed!\n");
+			}
+		} else {
+			printf("use: touch <path>\n");
+		}
+	} else if(!strcmp(cmd,"mkdir")) {
+		if(args==2) {
+			inumber = fs_mkdir(arg1);
+			if(inumber>0) {
+				printf("created directory %s as inode %d\n",arg1,inumber);
+			} else {
+				printf("mkdir failed!\n");
+			}
+		} else {
+			printf("use: mkdir <path>\n");
+		}
+	} else if(!strcmp(cmd,"rm")) {
+		if(args==2) {
+			if(fs_unlink(arg1)) {
+				printf("%s removed.\n",arg1);
+			} else {
+				printf("rm failed!\n");
+			}
+		} else {
+			printf("use: rm <path>\n");
+		}
+	} else if(!strcmp(cmd,"ls")) {
+		if(args<=2) {
+			result = fs_readdir(args==2 ? arg1 : "/",print_dirent,0);
+			if(result>=0) {
+				printf("%d entries\n",result);
+			} else {
+				printf("ls failed!\n");
+			}
+		} else {
+			printf("use: ls [path]\n");
+		}
+
+	} else if(!strcmp(cmd,"help")) {
+		printf("Commands are:\n");
+		printf("    format  [extents|large] [quick|discard]\n");
+		printf("    mount\n");
+		printf("    unmount\n");
+		printf("    debug\n");
+		printf("    create\n");
+		printf("    delete  <inode>\n");
+		printf("    fsync   <inode|path>\n");
+		printf("    begin\n");
+		printf("    commit\n");
+		printf("    stats   [reset|<file>]\n");
+		printf("    cat     <inode|path>\n");
+		printf("    copyin  <file> <inode|path>\n");
+		printf("    copyout <inode|path> <file>\n");
+		printf("    lookup  <path>\n");
+		printf("    touch   <path>\n");
+		printf("    mkdir   <path>\n");
+		printf("    rm      <path>\n");
+		printf("    ls      [path]\n");
+		printf("    time    <command>\n");
+		printf("    repeat  <count> <command>\n");
+		printf("    help\n");
+		printf("    quit\n");
+		printf("    exit\n");
+	} else if(!strcmp(cmd,"quit")) {
+		return 0;
+	} else if(!strcmp(cmd,"exit")) {
+		return 0;
+	} else {
+		printf("unknown command: %s\n",cmd);
+		printf("type 'help' for a list of commands.\n");
+	}
+
+	return 1;
+}
+
+/* run a line, taking off any time and repeat prefixes first */
+static int run_line( const char *line )
+{
+	char word[1024];
+	int count, used, i;
+
+	if(sscanf(line,"%s%n",word,&used)!=1) return 1;
+
+	if(!strcmp(word,"time")) {
+		return time_command(line+used);
+	}
+
+	if(!strcmp(word,"repeat")) {
+		line += used;
+		if(sscanf(line,"%d%n",&count,&used)!=1 || count<0 || sscanf(line+used,"%s",word)!=1) {
+			printf("use: repeat <count> <command>\n");
+			return 1;
+		}
+		for(i=0;i<count;i++) {
+			if(!run_line(line+used)) return 0;
+		}
+		return 1;
+	}
+
+	return do_command(line);
+}
+
+/* run a line and report the wall clock time and disk traffic it took */
+static int time_command( const char *line )
+{
+	struct stats before, after;
+	long start, elapsed, simulated;
+	long blocks[2] = { 0, 0 }, requests[2] = { 0, 0 };
+	int result, op, c, w;
+
+	stats_get(&before);
+	simulated = disk_model_time();
+	start = stats_now();
+
+	result = run_line(line);
+
+	elapsed = stats_now()-start;
+	simulated = disk_model_time()-simulated;
+	stats_get(&after);
+
+	for(w=0;w<2;w++) {
+		for(op=0;op<STATS_OPS;op++) {
+			for(c=0;c<STATS_CLASSES;c++) blocks[w] += after.blocks[op][c][w]-before.blocks[op][c][w];
+			requests[w] += after.requests[op][w]-before.requests[op][w];
+		}
+	}
+
+	printf("time: %.3f ms, %ld blocks read in %ld requests, %ld blocks written in %ld requests",elapsed/1e6,blocks[0],requests[0],blocks[1],requests[1]);
+	if(simulated) printf(", %.3f ms simulated",simulated/1e6);
+	printf("\n");
+
+	return result;
+}
+
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	struct fs_file *handle;
+	int result, actual;
+	long offset=0;
+	char buffer[16384] __attribute__((aligned(DISK_BLOCK_SIZE)));
+
+	handle = fs_open(inumber);
+	if(!handle) {
+		printf("couldn't open inode %d\n",inumber);
+		return 0;
+	}
 
 	file = fopen(filename,"r");
 	if(!file) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fs_close(handle);
 		return 0;
 	}
 
@@ -183,21 +466,27 @@ static int do_copyin( const char *filename, int inumber )
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result<=0) break;
 		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+			actual = fs_file_write(handle,buffer,result);
 			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
+				printf("ERROR: fs_file_write return invalid result %d\n",actual);
 				break;
 			}
 			offset += actual;
 			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				printf("WARNING: fs_file_write only wrote %d bytes, not %d bytes\n",actual,result);
 				break;
 			}
 		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	// blocks are only allocated once the buffered data is flushed
+	if(!fs_fsync(inumber)) {
+		printf("WARNING: fs_fsync could not write all of inode %d\n",inumber);
+	}
+
+	printf("%ld bytes copied\n",offset);
 
+	fs_close(handle);
 	fclose(file);
 	return 1;
 }
@@ -205,25 +494,55 @@ static int do_copyin( const char *filename, int inumber )
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
+	struct fs_file *handle;
+	int result;
+	long offset=0;
+	char buffer[16384] __attribute__((aligned(DISK_BLOCK_SIZE)));
+
+	handle = fs_open(inumber);
+	if(!handle) {
+		printf("couldn't open inode %d\n",inumber);
+		return 0;
+	}
 
 	file = fopen(filename,"w");
 	if(!file) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fs_close(handle);
 		return 0;
 	}
 
 	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
+		result = fs_file_read(handle,buffer,sizeof(buffer));
 		if(result<=0) break;
 		fwrite(buffer,1,result,file);
 		offset += result;
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%ld bytes copied\n",offset);
 
+	fs_close(handle);
 	fclose(file);
 	return 1;
 }
 
+/* an inode number, or a path to look up when the argument does not start with a digit */
+static int inode_arg( const char *arg )
+{
+	if(isdigit((unsigned char)arg[0])) return atoi(arg);
+	return fs_lookup(arg);
+}
+
+static void print_dirent( const char *name, int inumber, void *arg )
+{
+	printf("%8d %s%s\n",inumber,name,fs_isdir(inumber) ? "/" : "");
+}
+
+static int format_option( const char *opt )
+{
+	if(!strcmp(opt,"extents")) return FS_FORMAT_EXTENTS;
+	if(!strcmp(opt,"large")) return FS_FORMAT_LARGE;
+	if(!strcmp(opt,"quick")) return FS_FORMAT_QUICK;
+	if(!strcmp(opt,"discard")) return FS_FORMAT_DISCARD;
+	return -1;
+}
@@ -0,0 +1,205 @@
+
+/*
+I/O accounting. disk.c reports every request it carries out, and the
+blocks moved are counted by the class of each block and by the fs call
+running on the thread that asked for them. The filesystem tells this
+module which blocks are metadata; blocks it has said nothing about count
+as data. Latencies are kept as log2 histograms in microseconds.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+static const char *class_names[STATS_CLASSES] = { "data", "super", "inode", "bitmap", "indirect", "dir" };
+static const char *op_names[STATS_OPS] = { "none", "format", "mount", "unmount", "debug", "create", "delete", "getsize", "read", "write", "fsync", "commit", "lookup", "link", "unlink" };
+
+static struct stats stats;
+static unsigned char *classes;
+static int nblocks=0;
+static __thread int current_op;
+
+int stats_init( int n )
+{
+	free(classes);
+	classes = calloc(n,1);
+	nblocks = classes ? n : 0;
+	stats_reset();
+	return classes!=0;
+}
+
+void stats_set_class( int blocknum, int count, int cls )
+{
+	int i;
+	for(i=0;i<count;i++) {
+		if(blocknum+i>=0 && blocknum+i<nblocks) classes[blocknum+i] = cls;
+	}
+}
+
+int stats_op()
+{
+	return current_op;
+}
+
+void stats_set_op( int op )
+{
+	current_op = op;
+}
+
+long stats_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000000000L+t.tv_nsec;
+}
+
+static void hist_add( struct stats_hist *h, long ns )
+{
+	long us = ns/1000;
+	int b = us>0 ? 64-__builtin_clzl(us) : 0;
+
+	if(b>=STATS_BUCKETS) b = STATS_BUCKETS-1;
+	__sync_fetch_and_add(&h->count,1);
+	__sync_fetch_and_add(&h->total_ns,ns);
+	__sync_fetch_and_add(&h->buckets[b],1);
+}
+
+/* charge the calling thread's disk traffic to op until stats_end */
+void stats_begin( struct stats_span *span, int op )
+{
+	span->op = op;
+	span->outer = current_op;
+	span->start = stats_now();
+	current_op = op;
+}
+
+void stats_end( struct stats_span *span )
+{
+	hist_add(&stats.calls[span->op],stats_now()-span->start);
+	current_op = span->outer;
+}
+
+/* record one disk request of count blocks that took ns */
+void stats_io( int blocknum, int count, int write, long ns )
+{
+	long moved[STATS_CLASSES] = { 0 };
+	int i;
+
+	for(i=0;i<count;i++) {
+		int b = blocknum+i;
+		moved[b<nblocks ? classes[b] : STATS_DATA]++;
+	}
+	for(i=0;i<STATS_CLASSES;i++) {
+		if(moved[i]) __sync_fetch_and_add(&stats.blocks[current_op][i][write],moved[i]);
+	}
+	__sync_fetch_and_add(&stats.requests[current_op][write],1);
+	hist_add(&stats.disk[write],ns);
+}
+
+void stats_get( struct stats *s )
+{
+	*s = stats;
+}
+
+void stats_reset()
+{
+	memset(&stats,0,sizeof(stats));
+}
+
+static void print_hist( FILE *file, const char *name, struct stats_hist *h )
+{
+	int b;
+
+	if(!h->count) return;
+	fprintf(file,"    %-10s %8ld calls %10.1f us mean ",name,h->count,h->total_ns/1000.0/h->count);
+	for(b=0;b<STATS_BUCKETS;b++) {
+		if(h->buckets[b]) fprintf(file," <%ldus:%ld",1L<<b,h->buckets[b]);
+	}
+	fprintf(file,"\n");
+}
+
+/* a table of the blocks each call moved by class, then the latency histograms */
+void stats_print( FILE *file )
+{
+	struct stats s;
+	int op, c;
+
+	stats_get(&s);
+
+	fprintf(file,"blocks read/written by call and class:\n");
+	fprintf(file,"    %-10s","");
+	for(c=0;c<STATS_CLASSES;c++) fprintf(file," %15s",class_names[c]);
+	fprintf(file," %15s\n","requests");
+	for(op=0;op<STATS_OPS;op++) {
+		if(!s.requests[op][0] && !s.requests[op][1]) continue;
+		fprintf(file,"    %-10s",op_names[op]);
+		for(c=0;c<STATS_CLASSES;c++) {
+			char cell[32];
+			snprintf(cell,sizeof(cell),"%ld/%ld",s.blocks[op][c][0],s.blocks[op][c][1]);
+			fprintf(file," %15s",cell);
+		}
+		fprintf(file," %7ld/%-7ld\n",s.requests[op][0],s.requests[op][1]);
+	}
+
+	fprintf(file,"latency:\n");
+	print_hist(file,"disk read",&s.disk[0]);
+	print_hist(file,"disk write",&s.disk[1]);
+	for(op=1;op<STATS_OPS;op++) print_hist(file,op_names[op],&s.calls[op]);
+}
+
+static void dump_hist( FILE *file, const char *name, struct stats_hist *h, int last )
+{
+	int b;
+
+	fprintf(file,"    { \"name\": \"%s\", \"count\": %ld, \"total_ns\": %ld, \"buckets_us\": [",name,h->count,h->total_ns);
+	for(b=0;b<STATS_BUCKETS;b++) fprintf(file,"%s%ld",b ? ", " : "",h->buckets[b]);
+	fprintf(file,"] }%s\n",last ? "" : ",");
+}
+
+/*
+Write everything as JSON: one "io" entry per call and class that moved
+blocks, one "requests" entry per call, and one "latency" entry per
+histogram, where buckets_us[i] counts latencies below 2^i microseconds.
+*/
+int stats_dump( const char *filename )
+{
+	struct stats s;
+	FILE *file;
+	int op, c, first;
+
+	file = fopen(filename,"w");
+	if(!file) return 0;
+
+	stats_get(&s);
+
+	fprintf(file,"{\n  \"io\": [\n");
+	first = 1;
+	for(op=0;op<STATS_OPS;op++) {
+		for(c=0;c<STATS_CLASSES;c++) {
+			if(!s.blocks[op][c][0] && !s.blocks[op][c][1]) continue;
+			fprintf(file,"%s    { \"op\": \"%s\", \"class\": \"%s\", \"blocks_read\": %ld, \"blocks_written\": %ld }",first ? "" : ",\n",op_names[op],class_names[c],s.blocks[op][c][0],s.blocks[op][c][1]);
+			first = 0;
+		}
+	}
+	fprintf(file,"\n  ],\n  \"requests\": [\n");
+	first = 1;
+	for(op=0;op<STATS_OPS;op++) {
+		if(!s.requests[op][0] && !s.requests[op][1]) continue;
+		fprintf(file,"%s    { \"op\": \"%s\", \"reads\": %ld, \"writes\": %ld }",first ? "" : ",\n",op_names[op],s.requests[op][0],s.requests[op][1]);
+		first = 0;
+	}
+	fprintf(file,"\n  ],\n  \"latency\": [\n");
+	dump_hist(file,"disk_read",&s.disk[0],0);
+	dump_hist(file,"disk_write",&s.disk[1],0);
+	for(op=1;op<STATS_OPS;op++) {
+		char name[32];
+		snprintf(name,sizeof(name),"fs_%s",op_names[op]);
+		dump_hist(file,name,&s.calls[op],op==STATS_OPS-1);
+	}
+	fprintf(file,"  ]\n}\n");
+
+	return fclose(file)==0;
+}
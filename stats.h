@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/* what a disk block holds, as far as the filesystem has said */
+#define STATS_DATA      0
+#define STATS_SUPER     1
+#define STATS_INODE     2
+#define STATS_BITMAP    3
+#define STATS_INDIRECT  4 // indirect, overflow and tree pointer blocks
+#define STATS_DIR       5 // directory headers, indexes and buckets
+#define STATS_CLASSES   6
+
+/* the fs call disk traffic is charged to; nested calls charge the innermost */
+#define STATS_OP_NONE    0
+#define STATS_OP_FORMAT  1
+#define STATS_OP_MOUNT   2
+#define STATS_OP_UNMOUNT 3
+#define STATS_OP_DEBUG   4
+#define STATS_OP_CREATE  5
+#define STATS_OP_DELETE  6
+#define STATS_OP_GETSIZE 7
+#define STATS_OP_READ    8
+#define STATS_OP_WRITE   9
+#define STATS_OP_FSYNC   10
+#define STATS_OP_COMMIT  11 // fs_commit and the automatic group commits
+#define STATS_OP_LOOKUP  12 // fs_lookup and fs_readdir
+#define STATS_OP_LINK    13 // fs_create_path and fs_mkdir
+#define STATS_OP_UNLINK  14
+#define STATS_OPS        15
+
+#define STATS_BUCKETS   32 // bucket i counts latencies below 2^i microseconds and not below 2^(i-1)
+
+struct stats_hist {
+	long count;
+	long total_ns;
+	long buckets[STATS_BUCKETS];
+};
+
+struct stats {
+	long blocks[STATS_OPS][STATS_CLASSES][2]; // blocks moved, [0] read and [1] written
+	long requests[STATS_OPS][2];
+	struct stats_hist disk[2];                // disk request latency, read and write
+	struct stats_hist calls[STATS_OPS];       // fs call latency
+};
+
+struct stats_span {
+	int op;
+	int outer;
+	long start;
+};
+
+int  stats_init( int nblocks );
+void stats_set_class( int blocknum, int count, int cls );
+int  stats_op();
+void stats_set_op( int op );
+void stats_begin( struct stats_span *span, int op );
+void stats_end( struct stats_span *span );
+long stats_now();
+void stats_io( int blocknum, int count, int write, long ns );
+void stats_get( struct stats *s );
+void stats_reset();
+void stats_print( FILE *file );
+int  stats_dump( const char *filename );
+
+#endif
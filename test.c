@@ -0,0 +1,1011 @@
+
+/*
+Tests for the fs calls, run by make test. Every group formats a fresh
+scratch image in each inode format, once with the default cache and once
+with a cache small enough that held metadata fills it, and checks what
+comes back both before and after a remount:
+
+  binary   files of every byte value, copied in and out through file
+           handles in odd sized chunks, around block and indirect
+           boundaries and past a hole
+  dirs     names made, looked up and removed, the names fs_delete leaves
+           behind, and enough names in one directory to split buckets
+  threads  threads writing, reading, creating and deleting at once,
+           next to readers of one shared file
+
+Then the binary and threads groups run again on every disk backend,
+after a check of the vectored and range calls of the disk itself:
+
+  vectored one buffer per block in and out, aligned or not, ranges,
+           single blocks and the mapped block of the mmap backend
+
+Last, the pread backend runs binary, threads and a check of the queue
+itself again with disk workers behind it, in each format:
+
+  queue    a batch of requests submitted at once, waited for, and polled
+
+and on its own, where an image is copied while still mounted as if the
+machine had stopped there:
+
+  unclean  a copy taken after a commit mounts with a rebuilt bitmap, on
+           several threads, and unmounts to the same blocks as the
+           original does
+  formats  quick and discard formats over old files: the files are
+           gone, new ones show none of their bytes, a quick format
+           writes less than a full one and a discard one frees the
+           image's space
+  batches  nested fs_begin and fs_commit: nothing of a batch is on the
+           disk until the outermost commit, and then all of it is
+  trace    a recorded trace holds the requests the stats counted, and
+           simplefs-replay plays it onto a copy of the image but not
+           onto one too small for it
+  model    the hdd model charges seeks that the ssd one does not, and
+           both charge a queued batch the same as one run in place
+
+The scratch image is made with mkstemp in the current directory and
+removed at the end. Each failed check prints where it was, and the exit
+status is nonzero if any failed.
+*/
+
+#include "fs.h"
+#include "disk.h"
+#include "cache.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define TEST_BLOCKS   4096  // 16 MB images
+#define BATCH_FILES   1100  // more files than changes before an automatic commit
+#define MODEL_READS   16
+#define TEST_NAMES    2000  // names in the directory that has to split
+#define TEST_THREADS  8
+#define TEST_READERS  4
+#define TEST_ROUNDS   20
+#define TEST_FILESIZE (64*1024+123)
+#define TEST_SHARED   (256*1024)
+
+static const int formats[] = { 0, FS_FORMAT_EXTENTS, FS_FORMAT_LARGE };
+static const char *format_names[] = { "plain", "extents", "large" };
+static const int cache_sizes[] = { CACHE_DEFAULT_CAPACITY, 16 };
+static const int backends[] = { DISK_BACKEND_STDIO, DISK_BACKEND_MMAP, DISK_BACKEND_PREAD, DISK_BACKEND_DIRECT };
+static const char *backend_names[] = { "stdio", "mmap", "pread", "direct" };
+
+// sizes around the block, direct and indirect boundaries of every format
+static const int binary_sizes[] = { 1, 4095, 4096, 4097, 5*4096+1, 300000, 2*1024*1024+123 };
+
+#define NELEM(a) (sizeof(a)/sizeof(a[0]))
+
+static const char *filename;
+static int backend = DISK_BACKEND_STDIO;
+static int aio_depth = 0;
+static int format;      // flags of the format the running group started with
+static int failures = 0;
+
+#define CHECK(cond) do { if(!(cond)) { printf("    %s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); __sync_fetch_and_add(&failures,1); } } while(0)
+
+/* length pseudo random bytes from seed, zeros included */
+static void fill( char *data, int length, unsigned seed )
+{
+	int i;
+	for(i=0;i<length;i++) {
+		seed = seed*1103515245+12345;
+		data[i] = seed>>16;
+	}
+}
+
+/* disk_close and cache_close report their counters on stdout; keep them out of the output */
+static void close_quietly()
+{
+	int saved, null;
+
+	fflush(stdout);
+	saved = dup(1);
+	null = open("/dev/null",O_WRONLY);
+	if(null>=0) {
+		dup2(null,1);
+		close(null);
+	}
+
+	fs_unmount();
+	cache_close();
+	disk_close();
+
+	fflush(stdout);
+	if(saved>=0) {
+		dup2(saved,1);
+		close(saved);
+	}
+}
+
+static void start( int flags, int cacheblocks )
+{
+	if(truncate(filename,0)<0 || !disk_init_backend(filename,TEST_BLOCKS,backend)) {
+		printf("couldn't initialize %s: %s\n",filename,strerror(errno));
+		unlink(filename);
+		exit(1);
+	}
+	if(!disk_aio_init(aio_depth)) {
+		printf("couldn't start %d disk workers\n",aio_depth);
+		unlink(filename);
+		exit(1);
+	}
+	cache_init(cacheblocks);
+	if(!fs_format_flags(flags) || !fs_mount()) {
+		printf("couldn't format and mount %s\n",filename);
+		unlink(filename);
+		exit(1);
+	}
+}
+
+/* open another image as it is and mount it, without formatting */
+static int reopen( const char *image, int cacheblocks )
+{
+	if(!disk_open_backend(image,backend) || !disk_aio_init(aio_depth)) return 0;
+	cache_init(cacheblocks);
+	return fs_mount();
+}
+
+/* copy the image as it is on disk right now; only for backends that write straight through */
+static void snapshot( const char *copy )
+{
+	char buf[65536];
+	int in = open(filename,O_RDONLY);
+	int out = open(copy,O_WRONLY|O_CREAT|O_TRUNC,0600);
+	ssize_t n;
+
+	CHECK(in>=0 && out>=0);
+	while(in>=0 && out>=0 && (n=read(in,buf,sizeof(buf)))>0) {
+		CHECK(write(out,buf,n)==n);
+	}
+	if(in>=0) close(in);
+	if(out>=0) close(out);
+}
+
+/* whether two images hold the same bytes */
+static int same_image( const char *a, const char *b )
+{
+	char abuf[65536], bbuf[65536];
+	FILE *fa = fopen(a,"r"), *fb = fopen(b,"r");
+	size_t na, nb;
+	int same = fa && fb;
+
+	while(same) {
+		na = fread(abuf,1,sizeof(abuf),fa);
+		nb = fread(bbuf,1,sizeof(bbuf),fb);
+		same = na==nb && !memcmp(abuf,bbuf,na);
+		if(!na) break;
+	}
+	if(fa) fclose(fa);
+	if(fb) fclose(fb);
+	return same;
+}
+
+/* unmount, forget every cached block and mount again, so what follows comes from the disk */
+static void remount()
+{
+	CHECK(fs_unmount());
+	cache_invalidate();
+	CHECK(fs_mount());
+}
+
+/* copy length bytes into inumber through a handle, chunk bytes at a time */
+static int copy_in( int inumber, const char *data, int length, int chunk )
+{
+	struct fs_file *file = fs_open(inumber);
+	int done = 0, n;
+
+	if(!file) return 0;
+	while(done<length) {
+		n = length-done<chunk ? length-done : chunk;
+		if(fs_file_write(file,data+done,n)!=n) break;
+		done += n;
+	}
+	fs_close(file);
+	return done==length && fs_fsync(inumber);
+}
+
+/* read the whole of inumber through a handle, chunk bytes at a time; returns the bytes read */
+static int copy_out( int inumber, char *data, int length, int chunk )
+{
+	struct fs_file *file = fs_open(inumber);
+	int done = 0, n;
+
+	if(!file) return -1;
+	while(done<length) {
+		n = fs_file_read(file,data+done,length-done<chunk ? length-done : chunk);
+		if(n<=0) break;
+		done += n;
+	}
+	fs_close(file);
+	return done;
+}
+
+static void test_binary()
+{
+	int max = binary_sizes[NELEM(binary_sizes)-1];
+	char *data = malloc(max);
+	char *back = malloc(max+1);
+	int inodes[NELEM(binary_sizes)];
+	int i, hole, size;
+
+	if(!data || !back) {
+		printf("couldn't allocate the test buffers\n");
+		exit(1);
+	}
+
+	for(i=0;i<NELEM(binary_sizes);i++) {
+		size = binary_sizes[i];
+		fill(data,size,i+1);
+		// a whole block of zeros in the middle of the larger ones
+		if(size>3*4096) memset(data+4096,0,4096);
+
+		inodes[i] = fs_create();
+		CHECK(inodes[i]>0);
+		CHECK(copy_in(inodes[i],data,size,5000));
+		CHECK(fs_getsize(inodes[i])==size);
+		CHECK(copy_out(inodes[i],back,size+1,7000)==size);
+		CHECK(!memcmp(data,back,size));
+	}
+
+	// a write past the end leaves a hole that reads as zeros
+	hole = fs_create();
+	fill(data,5000,99);
+	CHECK(fs_write(hole,data,5000,3*4096+10)==5000);
+	CHECK(fs_fsync(hole));
+
+	remount();
+
+	for(i=0;i<NELEM(binary_sizes);i++) {
+		size = binary_sizes[i];
+		fill(data,size,i+1);
+		if(size>3*4096) memset(data+4096,0,4096);
+
+		CHECK(fs_getsize(inodes[i])==size);
+		memset(back,0x5a,size);
+		CHECK(fs_read(inodes[i],back,size,0)==size);
+		CHECK(!memcmp(data,back,size));
+	}
+
+	CHECK(fs_getsize(hole)==3*4096+10+5000);
+	memset(back,0x5a,3*4096+10+5000);
+	CHECK(fs_read(hole,back,3*4096+10+5000,0)==3*4096+10+5000);
+	for(i=0;i<3*4096+10 && !back[i];i++);
+	CHECK(i==3*4096+10);
+	fill(data,5000,99);
+	CHECK(!memcmp(data,back+3*4096+10,5000));
+
+	free(data);
+	free(back);
+}
+
+static void count_name( const char *name, int inumber, void *arg )
+{
+	(*(int *)arg)++;
+}
+
+static void test_dirs()
+{
+	static int inodes[TEST_NAMES];
+	char path[FS_NAME_MAX+16];
+	int a, b, d, x, n, i;
+
+	CHECK(fs_lookup("/")==FS_ROOT_INODE);
+	CHECK(fs_isdir(FS_ROOT_INODE));
+
+	a = fs_create_path("/a");
+	CHECK(a>0);
+	CHECK(fs_lookup("/a")==a);
+	CHECK(!fs_isdir(a));
+	CHECK(!fs_create_path("/a"));
+	CHECK(!fs_create_path("/nosuch/x"));
+	CHECK(!fs_create_path("/a/x"));
+
+	d = fs_mkdir("/d");
+	CHECK(d>0 && fs_isdir(d));
+	x = fs_create_path("/d/x");
+	CHECK(x>0);
+	CHECK(fs_lookup("/d/x")==x);
+	CHECK(!fs_unlink("/d"));
+	CHECK(!fs_delete(d));
+
+	// the longest name fits, one more does not
+	path[0] = '/';
+	memset(path+1,'n',FS_NAME_MAX);
+	path[FS_NAME_MAX+1] = 0;
+	CHECK(fs_create_path(path)>0);
+	path[FS_NAME_MAX+1] = 'n';
+	path[FS_NAME_MAX+2] = 0;
+	CHECK(!fs_create_path(path));
+
+	remount();
+	CHECK(fs_lookup("/a")==a);
+	CHECK(fs_lookup("/d/x")==x);
+	CHECK(fs_unlink("/d/x"));
+	CHECK(!fs_lookup("/d/x"));
+	CHECK(fs_unlink("/d"));
+	CHECK(!fs_lookup("/d"));
+
+	// a name fs_delete leaves behind leads nowhere, even once its inode is made again
+	CHECK(fs_delete(a));
+	b = fs_create();
+	CHECK(b>0);
+	CHECK(!fs_lookup("/a"));
+	remount();
+	CHECK(!fs_lookup("/a"));
+	n = 0;
+	CHECK(fs_readdir("/",count_name,&n)==1 && n==1);
+
+	// and removing it takes only the name
+	CHECK(fs_unlink("/a"));
+	CHECK(fs_getsize(b)==0);
+	CHECK(fs_delete(b));
+
+	// making the name again reuses the entry instead of adding a second one
+	a = fs_create_path("/a");
+	CHECK(fs_delete(a));
+	a = fs_create_path("/a");
+	CHECK(a>0);
+	remount();
+	CHECK(fs_lookup("/a")==a);
+	CHECK(fs_unlink("/a"));
+	CHECK(!fs_lookup("/a"));
+
+	// enough names to split buckets and double the index
+	CHECK(fs_mkdir("/many")>0);
+	for(i=0;i<TEST_NAMES;i++) {
+		sprintf(path,"/many/file%d",i);
+		inodes[i] = fs_create_path(path);
+		CHECK(inodes[i]>0);
+	}
+	remount();
+	for(i=0;i<TEST_NAMES;i++) {
+		sprintf(path,"/many/file%d",i);
+		CHECK(fs_lookup(path)==inodes[i]);
+		if(i%2==0) CHECK(fs_unlink(path));
+	}
+	remount();
+	n = 0;
+	CHECK(fs_readdir("/many",count_name,&n)==TEST_NAMES/2 && n==TEST_NAMES/2);
+	for(i=0;i<TEST_NAMES;i++) {
+		sprintf(path,"/many/file%d",i);
+		CHECK(fs_lookup(path)==(i%2 ? inodes[i] : 0));
+	}
+}
+
+struct worker {
+	int id;
+	int inumber;
+	int shared;
+	pthread_t thread;
+};
+
+/* rewrite one file over and over and read it back, with some create, delete and name churn alongside */
+static void *writer( void *arg )
+{
+	struct worker *w = arg;
+	char *data = malloc(TEST_FILESIZE);
+	char *back = malloc(TEST_FILESIZE);
+	char path[32];
+	int round, scratch, named;
+
+	for(round=0;round<TEST_ROUNDS && data && back;round++) {
+		fill(data,TEST_FILESIZE,w->id*1000+round);
+		CHECK(fs_write(w->inumber,data,TEST_FILESIZE,0)==TEST_FILESIZE);
+		if(round%4==0) CHECK(fs_fsync(w->inumber));
+		CHECK(fs_read(w->inumber,back,TEST_FILESIZE,0)==TEST_FILESIZE);
+		CHECK(!memcmp(data,back,TEST_FILESIZE));
+
+		// freed blocks must not turn up in the other threads' files
+		scratch = fs_create();
+		CHECK(scratch>0);
+		CHECK(fs_write(scratch,data,3*4096,0)==3*4096);
+		CHECK(fs_fsync(scratch));
+		CHECK(fs_delete(scratch));
+
+		sprintf(path,"/t%d-%d",w->id,round);
+		named = fs_create_path(path);
+		CHECK(named>0);
+		CHECK(fs_lookup(path)==named);
+		if(round%2) CHECK(fs_unlink(path));
+	}
+
+	free(data);
+	free(back);
+	return 0;
+}
+
+/* read the shared file in pieces and check every one */
+static void *reader( void *arg )
+{
+	struct worker *w = arg;
+	char *data = malloc(TEST_SHARED);
+	char *back = malloc(TEST_SHARED);
+	int round, offset, length;
+
+	if(data && back) {
+		fill(data,TEST_SHARED,4242);
+		for(round=0;round<TEST_ROUNDS*8;round++) {
+			offset = (round*40961+w->id*4099)%TEST_SHARED;
+			length = TEST_SHARED-offset<20000 ? TEST_SHARED-offset : 20000;
+			CHECK(fs_read(w->shared,back,length,offset)==length);
+			CHECK(!memcmp(data+offset,back,length));
+		}
+	}
+
+	free(data);
+	free(back);
+	return 0;
+}
+
+static void test_threads()
+{
+	struct worker workers[TEST_THREADS+TEST_READERS];
+	char *data = malloc(TEST_SHARED);
+	char path[32];
+	int shared, i, round;
+
+	if(!data) {
+		printf("couldn't allocate the test buffers\n");
+		exit(1);
+	}
+
+	shared = fs_create();
+	fill(data,TEST_SHARED,4242);
+	CHECK(fs_write(shared,data,TEST_SHARED,0)==TEST_SHARED);
+	CHECK(fs_fsync(shared));
+
+	for(i=0;i<TEST_THREADS+TEST_READERS;i++) {
+		workers[i].id = i;
+		workers[i].shared = shared;
+		workers[i].inumber = i<TEST_THREADS ? fs_create() : 0;
+		CHECK(pthread_create(&workers[i].thread,0,i<TEST_THREADS ? writer : reader,&workers[i])==0);
+	}
+	for(i=0;i<TEST_THREADS+TEST_READERS;i++) {
+		pthread_join(workers[i].thread,0);
+	}
+
+	remount();
+
+	// each file holds its last round, and the names of the even rounds are still there
+	for(i=0;i<TEST_THREADS;i++) {
+		char *back = malloc(TEST_FILESIZE);
+		fill(data,TEST_FILESIZE,i*1000+TEST_ROUNDS-1);
+		CHECK(back && fs_read(workers[i].inumber,back,TEST_FILESIZE,0)==TEST_FILESIZE);
+		CHECK(back && !memcmp(data,back,TEST_FILESIZE));
+		free(back);
+		for(round=0;round<TEST_ROUNDS;round++) {
+			sprintf(path,"/t%d-%d",i,round);
+			CHECK((fs_lookup(path)>0)==(round%2==0));
+		}
+	}
+
+	fill(data,TEST_SHARED,4242);
+	reader(&workers[TEST_THREADS]);
+
+	free(data);
+}
+
+/* blocks near the end of the disk, which the tests above never fill, written and read back without the filesystem */
+static void test_vectored()
+{
+	char *data, *back, *odd, *bufs[8];
+	int base = TEST_BLOCKS-32;
+	int i;
+
+	if(posix_memalign((void **)&data,DISK_BLOCK_SIZE,16*DISK_BLOCK_SIZE) || posix_memalign((void **)&back,DISK_BLOCK_SIZE,16*DISK_BLOCK_SIZE) || !(odd = malloc(8*DISK_BLOCK_SIZE+1))) {
+		printf("couldn't allocate the test buffers\n");
+		exit(1);
+	}
+	fill(data,16*DISK_BLOCK_SIZE,7);
+
+	// each block comes from its own buffer, here in reverse order
+	for(i=0;i<8;i++) bufs[i] = data+(size_t)(7-i)*DISK_BLOCK_SIZE;
+	disk_writev(base,bufs,8);
+	disk_read_range(base,8,back);
+	for(i=0;i<8;i++) CHECK(!memcmp(back+(size_t)i*DISK_BLOCK_SIZE,bufs[i],DISK_BLOCK_SIZE));
+
+	// buffers off a page boundary still arrive whole
+	for(i=0;i<8;i++) bufs[i] = odd+1+(size_t)i*DISK_BLOCK_SIZE;
+	memset(odd,0x5a,8*DISK_BLOCK_SIZE+1);
+	disk_readv(base,bufs,8);
+	for(i=0;i<8;i++) CHECK(!memcmp(bufs[i],data+(size_t)(7-i)*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE));
+
+	// a range read back one block at a time
+	disk_write_range(base+8,8,data+8*DISK_BLOCK_SIZE);
+	for(i=0;i<8;i++) {
+		disk_read(base+8+i,back);
+		CHECK(!memcmp(back,data+(size_t)(8+i)*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE));
+	}
+
+	// only the mmap backend hands out the block itself
+	if(backend==DISK_BACKEND_MMAP) {
+		const char *p = disk_block_ptr(base+8);
+		CHECK(p && !memcmp(p,data+8*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE));
+	} else {
+		CHECK(!disk_block_ptr(base+8));
+	}
+
+	free(data);
+	free(back);
+	free(odd);
+}
+
+static void check_files( const int *inodes, int n, int size, int seed )
+{
+	char *data = malloc(size), *back = malloc(size);
+	int i;
+
+	for(i=0;i<n && data && back;i++) {
+		fill(data,size,seed+i);
+		CHECK(fs_getsize(inodes[i])==size);
+		CHECK(fs_read(inodes[i],back,size,0)==size);
+		CHECK(!memcmp(data,back,size));
+	}
+	free(data);
+	free(back);
+}
+
+static void test_unclean()
+{
+	char copy[64];
+	char *data = malloc(300000);
+	int keep[4], gone = 0, i;
+
+	if(!data) {
+		printf("couldn't allocate the test buffers\n");
+		exit(1);
+	}
+	snprintf(copy,sizeof(copy),"%s.crash",filename);
+
+	// files with the blocks of a deleted one between them, all committed
+	for(i=0;i<4;i++) {
+		keep[i] = fs_create();
+		fill(data,300000,50+i);
+		CHECK(fs_write(keep[i],data,300000,0)==300000);
+		CHECK(fs_fsync(keep[i]));
+		if(i==1) {
+			gone = fs_create();
+			CHECK(fs_write(gone,data,100000,0)==100000);
+			CHECK(fs_fsync(gone));
+		}
+	}
+	CHECK(fs_delete(gone));
+	CHECK(fs_commit());
+	snapshot(copy);
+	close_quietly();
+
+	// the copy says it was never unmounted, so its bitmap is rebuilt from the inodes
+	fs_set_mount_threads(4);
+	CHECK(reopen(copy,CACHE_DEFAULT_CAPACITY));
+	fs_set_mount_threads(0);
+	check_files(keep,4,300000,50);
+	CHECK(fs_getsize(gone)<0);
+	close_quietly();
+	CHECK(same_image(filename,copy));
+
+	// and what it rebuilt hands out only free blocks
+	CHECK(reopen(copy,CACHE_DEFAULT_CAPACITY));
+	i = fs_create();
+	fill(data,300000,99);
+	CHECK(fs_write(i,data,300000,0)==300000);
+	CHECK(fs_fsync(i));
+	remount();
+	check_files(keep,4,300000,50);
+	check_files(&i,1,300000,99);
+
+	unlink(copy);
+	free(data);
+}
+
+/* format the unmounted disk with flags and mount it, returning the blocks the format wrote */
+static long format_writes( int flags )
+{
+	struct stats s;
+	long written = 0;
+	int c;
+
+	CHECK(fs_unmount());
+	stats_reset();
+	CHECK(fs_format_flags(flags));
+	stats_get(&s);
+	for(c=0;c<STATS_CLASSES;c++) written += s.blocks[STATS_OP_FORMAT][c][1];
+	CHECK(fs_mount());
+	return written;
+}
+
+/* blocks the image file takes on the host */
+static long image_blocks()
+{
+	struct stat st;
+	return stat(filename,&st)<0 ? -1 : (long)st.st_blocks;
+}
+
+static void test_formats()
+{
+	char *data = malloc(2*1024*1024);
+	char *back = malloc(3*4096+5100);
+	int old[2], i, n;
+	long quick, full, before;
+
+	if(!data || !back) {
+		printf("couldn't allocate the test buffers\n");
+		exit(1);
+	}
+
+	for(n=0;n<3;n++) {
+		// old files that fill the start of the data area
+		for(i=0;i<2;i++) {
+			old[i] = fs_create();
+			fill(data,2*1024*1024,70+i);
+			CHECK(fs_write(old[i],data,2*1024*1024,0)==2*1024*1024);
+			CHECK(fs_fsync(old[i]));
+		}
+		CHECK(fs_create_path("/old")>0);
+		CHECK(fs_commit());
+
+		if(n==0) {
+			quick = format_writes(format|FS_FORMAT_QUICK);
+		} else if(n==1) {
+			full = format_writes(format);
+			CHECK(quick+512<full);
+		} else {
+			before = image_blocks();
+			format_writes(format|FS_FORMAT_DISCARD);
+			CHECK(image_blocks()<before/4);
+		}
+
+		for(i=0;i<2;i++) CHECK(fs_getsize(old[i])<0);
+		CHECK(!fs_lookup("/old"));
+		CHECK(fs_readdir("/",count_name,&i)==0);
+
+		// a new file whose blocks land on the old data: all that was not written reads as zeros
+		i = fs_create();
+		fill(data,5000,80);
+		CHECK(fs_write(i,data,10,0)==10);
+		CHECK(fs_write(i,data+10,5000,3*4096+100)==5000);
+		CHECK(fs_fsync(i));
+		remount();
+		CHECK(fs_read(i,back,3*4096+5100,0)==3*4096+5100);
+		CHECK(!memcmp(back,data,10));
+		CHECK(!memcmp(back+3*4096+100,data+10,5000));
+		for(i=10;i<3*4096+100 && !back[i];i++);
+		CHECK(i==3*4096+100);
+	}
+
+	free(data);
+	free(back);
+}
+
+/* a batch reaches the disk only when its outermost fs_commit does, however much it holds */
+static void test_batches()
+{
+	char copies[3][64];
+	char *data = malloc(200000);
+	int files[BATCH_FILES], a, b, i, n;
+
+	if(!data) {
+		printf("couldn't allocate the test buffers\n");
+		exit(1);
+	}
+	for(n=0;n<3;n++) snprintf(copies[n],sizeof(copies[n]),"%s.batch%d",filename,n);
+
+	// more changes than an automatic commit waits for, all inside one batch
+	CHECK(fs_begin());
+	a = fs_create();
+	fill(data,200000,90);
+	CHECK(fs_write(a,data,200000,0)==200000);
+	for(i=0;i<BATCH_FILES;i++) files[i] = fs_create();
+	snapshot(copies[0]);
+
+	// a nested batch ends without committing anything
+	CHECK(fs_begin());
+	b = fs_create_path("/b");
+	CHECK(b>0);
+	fill(data,5000,91);
+	CHECK(fs_write(b,data,5000,0)==5000);
+	CHECK(fs_commit());
+	snapshot(copies[1]);
+
+	CHECK(fs_commit());
+	snapshot(copies[2]);
+	close_quietly();
+
+	for(n=0;n<3;n++) {
+		CHECK(reopen(copies[n],CACHE_DEFAULT_CAPACITY));
+		if(n<2) {
+			CHECK(fs_getsize(a)<0);
+			CHECK(fs_getsize(files[BATCH_FILES-1])<0);
+			CHECK(!fs_lookup("/b"));
+		} else {
+			check_files(&a,1,200000,90);
+			check_files(&b,1,5000,91);
+			CHECK(fs_lookup("/b")==b);
+			for(i=0;i<BATCH_FILES;i++) CHECK(fs_getsize(files[i])==0);
+		}
+		close_quietly();
+		unlink(copies[n]);
+	}
+
+	// and outside any batch fs_commit commits at once
+	CHECK(reopen(filename,CACHE_DEFAULT_CAPACITY));
+	i = fs_create();
+	CHECK(fs_write(i,data,5000,0)==5000);
+	CHECK(fs_commit());
+	snapshot(copies[0]);
+	close_quietly();
+	CHECK(reopen(copies[0],CACHE_DEFAULT_CAPACITY));
+	check_files(&i,1,5000,91);
+	close_quietly();
+	unlink(copies[0]);
+
+	// leave the image mounted for run to close
+	CHECK(reopen(filename,CACHE_DEFAULT_CAPACITY));
+	free(data);
+}
+
+/* the trace holds every request the stats counted, and the replay tool takes it */
+static void test_trace()
+{
+	char tracefile[64], copy[64], command[256];
+	char *data = malloc(300000);
+	long requests[STATS_OPS][2], blocks[STATS_OPS][2], total, moved[2] = {0,0};
+	struct disk_trace_header header;
+	struct disk_trace_record r;
+	struct stats s;
+	struct stat st;
+	FILE *file;
+	int i, op, w, bad = 0;
+
+	if(!data) {
+		printf("couldn't allocate the test buffers\n");
+		exit(1);
+	}
+	snprintf(tracefile,sizeof(tracefile),"%s.trace",filename);
+	snprintf(copy,sizeof(copy),"%s.replay",filename);
+
+	// nothing left to commit, so the timer stays quiet while the trace is open
+	CHECK(fs_commit());
+	stats_reset();
+	CHECK(disk_trace_open(tracefile));
+	i = fs_create();
+	fill(data,300000,60);
+	CHECK(fs_write(i,data,300000,0)==300000);
+	CHECK(fs_fsync(i));
+	CHECK(fs_create_path("/traced")>0);
+	remount();
+	check_files(&i,1,300000,60);
+	CHECK(fs_delete(i));
+	CHECK(fs_commit());
+	disk_trace_close();
+	stats_get(&s);
+
+	memset(requests,0,sizeof(requests));
+	memset(blocks,0,sizeof(blocks));
+	file = fopen(tracefile,"r");
+	CHECK(file && fread(&header,sizeof(header),1,file)==1);
+	CHECK(header.magic==DISK_TRACE_MAGIC && header.nblocks==TEST_BLOCKS);
+	while(file && fread(&r,sizeof(r),1,file)==1) {
+		if(r.op>=STATS_OPS || r.write>1 || !r.count || r.blocknum+r.count>TEST_BLOCKS) {
+			bad++;
+			continue;
+		}
+		requests[r.op][r.write]++;
+		blocks[r.op][r.write] += r.count;
+	}
+	if(file) fclose(file);
+	CHECK(!bad);
+	for(op=0;op<STATS_OPS;op++) {
+		for(w=0;w<2;w++) {
+			for(total=0,i=0;i<STATS_CLASSES;i++) total += s.blocks[op][i][w];
+			CHECK(requests[op][w]==s.requests[op][w]);
+			CHECK(blocks[op][w]==total);
+			moved[w] += blocks[op][w];
+		}
+	}
+	CHECK(moved[0]>=300000/DISK_BLOCK_SIZE && moved[1]>=300000/DISK_BLOCK_SIZE);
+
+	// replayed onto a copy of the image, which keeps its size; a smaller image is refused and left as it is
+	if(access("./simplefs-replay",X_OK)==0) {
+		snapshot(copy);
+		snprintf(command,sizeof(command),"./simplefs-replay %s %s -f >/dev/null",tracefile,copy);
+		CHECK(system(command)==0);
+		CHECK(stat(copy,&st)==0 && st.st_size==(off_t)TEST_BLOCKS*DISK_BLOCK_SIZE);
+		CHECK(truncate(copy,(off_t)TEST_BLOCKS/2*DISK_BLOCK_SIZE)==0);
+		CHECK(system(command)!=0);
+		CHECK(stat(copy,&st)==0 && st.st_size==(off_t)TEST_BLOCKS/2*DISK_BLOCK_SIZE);
+		unlink(copy);
+	} else {
+		printf("    no ./simplefs-replay, the replay is not checked\n");
+	}
+
+	unlink(tracefile);
+	free(data);
+}
+
+/* model time charged for one block reads of blocks, starting with the head at block 0 */
+static long model_cost( int model, const int *blocks, int n, char *buf )
+{
+	struct disk_request reqs[MODEL_READS];
+	long before;
+	int i;
+
+	disk_set_model(model);
+	disk_read(0,buf);
+	before = disk_model_time();
+	for(i=0;i<n;i++) {
+		reqs[i].blocknum = blocks[i];
+		reqs[i].count = 1;
+		reqs[i].write = 0;
+		reqs[i].data = buf+(size_t)i*DISK_BLOCK_SIZE;
+	}
+	disk_submit(reqs,n);
+	disk_wait(reqs,n);
+	before = disk_model_time()-before;
+	disk_set_model(DISK_MODEL_NONE);
+	return before;
+}
+
+/* the device models charge for seeks and for nothing else that varies, the same with or without a queue */
+static void test_model()
+{
+	int sequential[MODEL_READS], scattered[MODEL_READS], i;
+	long hdd_sequential, hdd_scattered, ssd_sequential, ssd_scattered;
+	char *buf;
+
+	if(posix_memalign((void **)&buf,DISK_BLOCK_SIZE,MODEL_READS*DISK_BLOCK_SIZE)) {
+		printf("couldn't allocate the test buffers\n");
+		exit(1);
+	}
+	for(i=0;i<MODEL_READS;i++) {
+		sequential[i] = TEST_BLOCKS/2+i;
+		scattered[i] = (i*1543+700)%TEST_BLOCKS;
+	}
+
+	// nothing left to commit, so only these reads reach the disk
+	CHECK(fs_commit());
+	CHECK(model_cost(DISK_MODEL_NONE,scattered,MODEL_READS,buf)==0);
+
+	hdd_sequential = model_cost(DISK_MODEL_HDD,sequential,MODEL_READS,buf);
+	hdd_scattered = model_cost(DISK_MODEL_HDD,scattered,MODEL_READS,buf);
+	ssd_sequential = model_cost(DISK_MODEL_SSD,sequential,MODEL_READS,buf);
+	ssd_scattered = model_cost(DISK_MODEL_SSD,scattered,MODEL_READS,buf);
+	CHECK(hdd_sequential>0 && hdd_sequential*4<hdd_scattered);
+	CHECK(ssd_scattered>0 && ssd_scattered*4<hdd_scattered);
+	CHECK(ssd_sequential==ssd_scattered);
+	CHECK(model_cost(DISK_MODEL_HDD,scattered,MODEL_READS,buf)==hdd_scattered);
+
+	// queued to workers, the same requests are charged the same
+	CHECK(disk_aio_init(4));
+	CHECK(model_cost(DISK_MODEL_HDD,scattered,MODEL_READS,buf)==hdd_scattered);
+	CHECK(model_cost(DISK_MODEL_SSD,scattered,MODEL_READS,buf)==ssd_scattered);
+	CHECK(disk_aio_init(0));
+
+	free(buf);
+}
+
+/* requests queued all at once come back done, whatever order the workers took them in */
+static void test_queue()
+{
+	struct disk_request reqs[32];
+	char *data, *back;
+	int base = TEST_BLOCKS-64;
+	int i, pending;
+
+	if(posix_memalign((void **)&data,DISK_BLOCK_SIZE,64*DISK_BLOCK_SIZE) || posix_memalign((void **)&back,DISK_BLOCK_SIZE,64*DISK_BLOCK_SIZE)) {
+		printf("couldn't allocate the test buffers\n");
+		exit(1);
+	}
+	fill(data,64*DISK_BLOCK_SIZE,11);
+	memset(back,0x5a,64*DISK_BLOCK_SIZE);
+
+	// single blocks going down interleaved with pairs going up, so no two can merge
+	for(i=0;i<32;i++) {
+		int first = i%2 ? 16+(i/2)*2 : 15-i/2;
+		reqs[i].blocknum = base+first;
+		reqs[i].count = i%2 ? 2 : 1;
+		reqs[i].write = 1;
+		reqs[i].data = data+(size_t)first*DISK_BLOCK_SIZE;
+	}
+	disk_submit(reqs,32);
+	disk_wait(reqs,32);
+	for(i=0;i<32;i++) CHECK(reqs[i].done);
+
+	// read the 48 blocks back as 24 requests of two, polled instead of waited for
+	for(i=0;i<24;i++) {
+		reqs[i].blocknum = base+i*2;
+		reqs[i].count = 2;
+		reqs[i].write = 0;
+		reqs[i].data = back+(size_t)i*2*DISK_BLOCK_SIZE;
+	}
+	disk_submit(reqs,24);
+	do {
+		pending = 0;
+		for(i=0;i<24;i++) pending += !disk_poll(&reqs[i]);
+	} while(pending);
+	disk_wait(reqs,24);
+	CHECK(!memcmp(data,back,48*DISK_BLOCK_SIZE));
+
+	free(data);
+	free(back);
+}
+
+static void run( const char *name, void (*test)(), int f, int c )
+{
+	int before = failures;
+
+	format = formats[f];
+	start(format,cache_sizes[c]);
+	test();
+	close_quietly();
+
+	printf("%-8s %-8s %-6s q=%d cache=%-4d %s\n",name,format_names[f],backend_names[backend],aio_depth,cache_sizes[c],failures==before ? "ok" : "FAILED");
+}
+
+int main( int argc, char *argv[] )
+{
+	char scratch[] = "test.img.XXXXXX";
+	int fd, f, c, b;
+
+	fd = mkstemp(scratch);
+	if(fd<0) {
+		printf("couldn't create a scratch image: %s\n",strerror(errno));
+		return 1;
+	}
+	close(fd);
+	filename = scratch;
+
+	for(f=0;f<NELEM(formats);f++) {
+		for(c=0;c<NELEM(cache_sizes);c++) {
+			run("binary",test_binary,f,c);
+			run("dirs",test_dirs,f,c);
+			run("threads",test_threads,f,c);
+		}
+	}
+
+	for(b=0;b<NELEM(backends);b++) {
+		backend = backends[b];
+		run("vectored",test_vectored,0,0);
+		run("binary",test_binary,0,0);
+		run("threads",test_threads,0,0);
+	}
+
+	backend = DISK_BACKEND_PREAD;
+	aio_depth = 4;
+	for(f=0;f<NELEM(formats);f++) {
+		run("queue",test_queue,f,0);
+		run("binary",test_binary,f,0);
+		run("threads",test_threads,f,1);
+	}
+	backend = DISK_BACKEND_STDIO;
+	aio_depth = 0;
+
+	backend = DISK_BACKEND_PREAD;
+	for(f=0;f<NELEM(formats);f++) {
+		run("unclean",test_unclean,f,0);
+	}
+	for(f=0;f<NELEM(formats);f++) {
+		run("formats",test_formats,f,0);
+	}
+	for(f=0;f<NELEM(formats);f++) {
+		run("batches",test_batches,f,0);
+	}
+	run("trace",test_trace,0,0);
+	run("model",test_model,0,0);
+	backend = DISK_BACKEND_STDIO;
+
+	unlink(filename);
+
+	if(failures) {
+		printf("%d checks failed\n",failures);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}